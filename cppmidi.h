@@ -12,11 +12,28 @@
 #include <thread>
 #include <functional>
 #include <cmath>
+#include <limits>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <tuple>
+#include <utility>
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
 
 
 namespace midi{
 	typedef u_int32_t event_delta_t;
 	typedef unsigned char channel_t;
+	typedef uint64_t timestamp_t; // Absolute microseconds from the start of the song
+
+	enum LoadOptions : uint32_t{
+		LOAD_DEFAULT = 0,
+		LOAD_TIMESTAMPS = 1 << 0, // Compute an absolute timestamp for every event while parsing
+		LOAD_INDEX = 1 << 1 // Build per type/channel posting lists of channel events
+	};
 
 	enum TrackFormat : int16_t{
 		SINGLE = 0,
@@ -61,9 +78,66 @@ namespace midi{
 		META=0xFF
 	};
 
+	enum RealtimeOptions : uint32_t{
+		REALTIME_NONE = 0,
+		REALTIME_PRIORITY = 1 << 0, // Run the playing thread under SCHED_FIFO
+		REALTIME_AFFINITY = 1 << 1, // Pin the playing thread to one CPU
+		REALTIME_LOCK_MEMORY = 1 << 2, // mlockall the process's current and future pages, stays in effect for the whole process
+		REALTIME_PREFAULT = 1 << 3 // Touch the event arrays and some stack before playing
+	};
+
+	enum NotePairingOptions : uint32_t{
+		PAIR_DEFAULT = 0,
+		PAIR_SUSTAIN = 1 << 0 // Hold note ends while the sustain pedal (CC64) is down
+	};
+
 	class MIDI;
 	class Track;
 
+	// A NOTE_ON paired with the NOTE_OFF (or zero velocity NOTE_ON) that ends it
+	struct Note{
+		event_delta_t start;
+		event_delta_t end;
+		uint16_t track;
+		channel_t channel;
+		unsigned char pitch;
+		unsigned char velocity;
+	};
+
+	class TempoMap{
+		public:
+		struct TempoChange{
+			event_delta_t tick;
+			timestamp_t micros; // Time at which the change takes effect
+			uint32_t usPerBeat;
+		};
+
+		// Conversions are O(log n) in the number of tempo changes
+		timestamp_t tickToMicros(event_delta_t tick) const;
+		// Last tick at or before the given time
+		event_delta_t microsToTick(timestamp_t micros) const;
+
+		// Tempo in effect from the given tick on
+		uint32_t getTempoAt(event_delta_t tick) const;
+
+		// Always contains at least the default 120bpm tempo at tick 0
+		const std::vector<TempoChange>& getChanges() const;
+
+		private:
+		void reset(uint16_t ticksPerBeat);
+		void addChange(event_delta_t tick, uint32_t usPerBeat);
+
+		// Bumped on every change so tracks parsed earlier can tell their timestamps are stale
+		uint32_t getRevision() const;
+
+		uint16_t ticksPerBeat = 0;
+		uint32_t revision = 0;
+		std::vector<TempoChange> changes;
+
+		friend class MIDI;
+		friend class Track;
+	};
+
 	class Header{
 		public:
 		TrackFormat getType() const;
@@ -120,9 +194,20 @@ namespace midi{
 				char LSB;
 				char MSB;
 			} pitchBend, songPosPointer;
+
+			struct EventTimeSignature {
+				unsigned char numerator;
+				unsigned char denominator; // Power of two, 3 means x/8
+				unsigned char clocksPerClick;
+				unsigned char notated32ndsPerBeat;
+			} timeSignature;
 		} eventData;
 		public:
 
+		Event() = default;
+		// Channel event with up to two data bytes, eg. Event(CONTROLLER, 0, 64, 127)
+		Event(TrackEventType type, channel_t channel, unsigned char data1, unsigned char data2 = 0, event_delta_t tick = 0);
+
 		const EventData& getData() const;
 		
 		event_delta_t getTickDelta() const;
@@ -155,64 +240,1034 @@ namespace midi{
 		friend class Track;
 	};
 
+	// Contiguous run of events within a single track
+	class EventRange{
+		public:
+		EventRange(const Event* first, const Event* last);
+
+		const Event* begin() const;
+		const Event* end() const;
+
+		size_t size() const;
+		bool empty() const;
+
+		private:
+		const Event* first;
+		const Event* last;
+	};
+
+	class BarMap{
+		public:
+		struct Position{
+			uint32_t bar;
+			uint32_t beat;
+			event_delta_t tickInBeat;
+		};
+
+		struct Segment{
+			event_delta_t tick;
+			uint32_t bar; // Bar number the time signature starts on
+			unsigned char numerator;
+			unsigned char denominator; // Power of two, as in the event
+			event_delta_t ticksPerBeat;
+			event_delta_t ticksPerBar;
+		};
+
+		// Both conversions are O(log n) in the number of time signature changes
+		Position tickToPosition(event_delta_t tick) const;
+		event_delta_t positionToTick(const Position& position) const;
+
+		event_delta_t getBarStart(uint32_t bar) const;
+
+		// Always contains at least the default 4/4 signature at tick 0
+		const std::vector<Segment>& getSegments() const;
+
+		private:
+		void reset(uint16_t ticksPerBeat);
+		// Signatures that don't land on a bar line start a new bar early
+		void addTimeSignature(event_delta_t tick, unsigned char numerator, unsigned char denominator);
+
+		Segment makeSegment(event_delta_t tick, unsigned char numerator, unsigned char denominator) const;
+		const Segment& getSegmentOfBar(uint32_t bar) const;
+
+		uint16_t ticksPerBeat = 0;
+		std::vector<Segment> segments;
+
+		friend class MIDI;
+		friend class Track;
+	};
+
+	// Ascending event indices within a track, stored as deltas from the previous index
+	// in the MIDI variable length encoding, so nearby events take a single byte each
+	class PostingList{
+		public:
+		class const_iterator{
+			public:
+			typedef std::forward_iterator_tag iterator_category;
+			typedef uint32_t value_type;
+			typedef std::ptrdiff_t difference_type;
+			typedef const uint32_t* pointer;
+			typedef uint32_t reference;
+
+			uint32_t operator*() const;
+			const_iterator& operator++();
+			bool operator==(const const_iterator& other) const;
+			bool operator!=(const const_iterator& other) const;
+
+			private:
+			const_iterator(const uint8_t* position, uint32_t base);
+
+			const uint8_t* position; // First byte of the next delta
+			uint32_t base; // Sum of the deltas before this one
+
+			friend class PostingList;
+		};
+
+		const_iterator begin() const;
+		const_iterator end() const;
+
+		size_t size() const;
+		bool empty() const;
+
+		private:
+		void push_back(uint32_t index);
+
+		std::vector<uint8_t> deltas;
+		uint32_t count = 0;
+		uint32_t last = 0;
+
+		friend class EventIndex;
+	};
+
+	class EventIndex{
+		public:
+		// Channel events of a type on a channel, eg. all NOTE_ON on channel 9
+		const PostingList& find(TrackEventType type, channel_t channel) const;
+		// CONTROLLER events for one controller number on a channel
+		const PostingList& findController(channel_t channel, unsigned char controller) const;
+
+		private:
+		void add(const Event& event, uint32_t index);
+
+		std::unordered_map<uint16_t, PostingList> typePostings; // Keyed by status byte
+		std::unordered_map<uint16_t, PostingList> controllerPostings; // Keyed by channel << 7 | controller
+
+		friend class Track;
+	};
+
 	class Track{
 		public:
 
 		const std::vector<Event>& getEvents() const;
 		const Event& getEvent(int index) const;
 
+		// Parallel to getEvents(), empty unless loaded with LOAD_TIMESTAMPS
+		const std::vector<timestamp_t>& getTimestamps() const;
+		timestamp_t getTimestamp(int index) const;
+
+		// Events with first <= tick < last, O(log n)
+		EventRange eventsInRange(event_delta_t first, event_delta_t last) const;
+		// Index of the first event at or after tick, O(log n)
+		size_t getEventIndexAt(event_delta_t tick) const;
+
+		// Empty unless loaded with LOAD_INDEX
+		const EventIndex& getIndex() const;
+
+		// Notes in order of their start, see MIDI::getNotes
+		std::vector<Note> getNotes(uint32_t options = PAIR_DEFAULT) const;
+
 
 		private:
-		bool readTrackChunk(std::ifstream& inputfile);
+		bool readTrackChunk(std::ifstream& inputfile, TempoMap& tempoMap, BarMap& barMap, uint32_t options);
+		void computeTimestamps(const TempoMap& tempoMap);
 
 		std::vector<Event> events;
+		std::vector<timestamp_t> timestamps;
+		EventIndex index;
 
 		friend class MIDI;
 	};
 
 	class MIDI{
 		public:
-		bool loadFile(const char* filename);
+		bool loadFile(const char* filename, uint32_t options = LOAD_DEFAULT);
+		// Loads an immutable snapshot that players can share, nullptr on failure
+		static std::shared_ptr<const MIDI> loadShared(const char* filename, uint32_t options = LOAD_DEFAULT);
 
 		const Header& getHeader() const;
 		const std::vector<Track>& getTracks() const;
 		const Track& getTrack(int track) const;
 		const Event& getEvent(int track, int index) const;
 
+		const TempoMap& getTempoMap() const;
+		const BarMap& getBarMap() const;
+
+		// One range per track of events with first <= tick < last, O(tracks * log n)
+		std::vector<EventRange> eventsInRange(event_delta_t first, event_delta_t last) const;
+
+		// Events of a track that fall within the given bar
+		EventRange eventsInBar(int track, uint32_t bar) const;
+
+		// Notes of every track in order of their start, ties keep track order
+		//	Note offs end the most recent open note of the same channel and pitch,
+		//	notes still open at the end of a track end on its last tick
+		std::vector<Note> getNotes(uint32_t options = PAIR_DEFAULT) const;
+
 		private:
 		bool readHeaderChunk(std::ifstream& inputFile);
-		bool readTrackChunk(std::ifstream& inputFile);
+		bool readTrackChunk(std::ifstream& inputFile, uint32_t options);
 
 		Header header;
+		TempoMap tempoMap;
+		BarMap barMap;
 
 		std::vector<Track> tracks;
 
 		event_delta_t currentTick;
 	};
 
+	// Centered interval tree over the paired notes of a MIDI
+	//	Queries are O(log n + k), results come back in no particular order
+	class NoteIndex{
+		public:
+		NoteIndex(const MIDI& midiObject, uint32_t options = PAIR_DEFAULT);
+
+		// Notes with start <= tick < end
+		std::vector<const Note*> notesAt(event_delta_t tick) const;
+		// Notes sounding anywhere within first <= tick < last
+		std::vector<const Note*> notesIn(event_delta_t first, event_delta_t last) const;
+
+		const std::vector<Note>& getNotes() const;
+
+		private:
+		struct Node{
+			event_delta_t center;
+			uint32_t first; // Notes overlapping center, in byStart and byEnd
+			uint32_t count;
+			int32_t left;
+			int32_t right;
+		};
+
+		// Returns the node index, or -1 if there are no notes
+		int32_t build(std::vector<uint32_t>& notesByStart);
+		// Notes sounding anywhere within first <= tick <= last, so a window can end on the last tick
+		void collect(int32_t node, event_delta_t first, event_delta_t last, std::vector<const Note*>& found) const;
+
+		std::vector<Note> notes;
+		std::vector<Node> nodes;
+		std::vector<uint32_t> byStart; // Ascending start within each node
+		std::vector<uint32_t> byEnd; // Descending end within each node
+		int32_t root;
+	};
+
+	// Program, controllers, pitch bend and pressure of a channel, -1 where never set
+	struct ChannelState{
+		int16_t program;
+		int16_t pitchBend; // 14 bit, 0x2000 is centred
+		int16_t pressure;
+		int8_t controllers[128]; // Channel mode messages (120-127) and data increments (96, 97) aren't kept
+		bool nrpnSelected; // Whether data entry goes to the NRPN rather than the RPN
+	};
+
+	// State of all 16 channels at a point in the song
+	class ChannelSnapshot{
+		public:
+		ChannelSnapshot();
+
+		// Updates the state with PROGRAM, CONTROLLER, PITCH_BEND_CHANGE and CHANNEL_PRESSURE events
+		//	Reset All Controllers (CC121) puts back the defaults of RP-015
+		void apply(const Event& event);
+
+		// Events that recreate the state, bank select is sent before the program
+		//	and the RPN/NRPN select before data entry
+		void getEvents(event_delta_t tick, std::vector<Event>& out) const;
+
+		const ChannelState& getChannel(channel_t channel) const;
+
+		private:
+		ChannelState channels[16];
+	};
+
+	// Channel state snapshots at the start of every interval ticks that changes the state
+	//	Restoring the state at any tick replays at most interval ticks worth of events
+	class ChannelStateIndex{
+		public:
+		ChannelStateIndex(const MIDI& midiObject, event_delta_t interval);
+
+		// State after every event before tick, O(log n + events in one interval)
+		ChannelSnapshot getStateAt(event_delta_t tick) const;
+
+		private:
+		struct Checkpoint{
+			event_delta_t tick;
+			ChannelSnapshot state; // After every event before tick
+		};
+
+		event_delta_t interval;
+		std::vector<Checkpoint> checkpoints; // Ascending ticks, the first at tick 0
+		std::vector<Event> stateEvents; // Every state changing event, in playback order
+	};
+
+	typedef std::function<void(const Event&)> EventCallback;
+
+	// Deadline of a player with nothing left to play
+	const int64_t NO_DEADLINE = std::numeric_limits<int64_t>::max();
+	// Also given the event's time on the playback timeline
+	typedef std::function<void(const Event&, timestamp_t)> TimedEventCallback;
+	// Every event of one tick, merged across tracks in dispatch order
+	typedef std::function<void(const EventRange&, timestamp_t)> BatchCallback;
+
+	// Lock-free log-linear histogram in the style of HdrHistogram
+	//	Values are bucketed with 16 sub-buckets per power of two, so reported values are within ~6%
+	class LatencyHistogram{
+		public:
+		LatencyHistogram();
+
+		// Safe to call from any thread
+		void record(uint64_t value);
+		void reset();
+
+		// Highest value equivalent to the given fraction of recorded values, eg. 0.99
+		uint64_t getPercentile(double fraction) const;
+		uint64_t getMax() const;
+		uint64_t getCount() const;
+
+		private:
+		static const int SUB_BUCKET_BITS = 4;
+		static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+		static const int BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+		static size_t getBucket(uint64_t value);
+		static uint64_t getBucketMax(size_t bucket);
+
+		std::atomic<uint64_t> counts[BUCKETS];
+		std::atomic<uint64_t> count;
+		std::atomic<uint64_t> max;
+	};
+
+	// Wait-free single producer, single consumer ring buffer
+	template<typename T>
+	class SPSCQueue{
+		public:
+		// Capacity is rounded up to a power of two
+		explicit SPSCQueue(size_t capacity);
+
+		// Producer thread only, returns false when full
+		bool push(const T& item);
+		// Consumer thread only, returns false when empty
+		bool pop(T& item);
+
+		size_t getCapacity() const;
+
+		private:
+		std::vector<T> buffer;
+		size_t mask;
+
+		std::atomic<size_t> head; // Next slot to pop
+		char padding[64]; // Keeps head and tail on separate cache lines so the two threads don't contend
+		std::atomic<size_t> tail; // Next slot to push
+	};
+
+	template<typename T>
+	SPSCQueue<T>::SPSCQueue(size_t capacity) : head(0), tail(0){
+		size_t size = 1;
+		while(size < capacity) size <<= 1;
+
+		buffer.resize(size);
+		mask = size - 1;
+	}
+
+	template<typename T>
+	bool SPSCQueue<T>::push(const T& item){
+		const size_t currentTail = tail.load(std::memory_order_relaxed);
+		if(currentTail - head.load(std::memory_order_acquire) > mask) return false;
+
+		buffer[currentTail & mask] = item;
+		tail.store(currentTail + 1, std::memory_order_release);
+		return true;
+	}
+
+	template<typename T>
+	bool SPSCQueue<T>::pop(T& item){
+		const size_t currentHead = head.load(std::memory_order_relaxed);
+		if(currentHead == tail.load(std::memory_order_acquire)) return false;
+
+		item = buffer[currentHead & mask];
+		head.store(currentHead + 1, std::memory_order_release);
+		return true;
+	}
+
+	template<typename T>
+	size_t SPSCQueue<T>::getCapacity() const{
+		return buffer.size();
+	}
+
+	// Lock-free bounded multi producer, single consumer queue, after Dmitry Vyukov's design
+	//	Every slot carries a sequence number telling producers and the consumer whose turn it is
+	template<typename T>
+	class MPSCQueue{
+		public:
+		// Capacity is rounded up to a power of two
+		explicit MPSCQueue(size_t capacity);
+
+		// Any thread, returns false when full
+		bool push(const T& item);
+		// Consumer thread only, returns false when empty
+		bool pop(T& item);
+		// Consumer thread only
+		bool empty() const;
+
+		size_t getCapacity() const;
+
+		private:
+		struct Cell{
+			std::atomic<size_t> sequence;
+			T item;
+		};
+
+		std::unique_ptr<Cell[]> cells;
+		size_t mask;
+
+		std::atomic<size_t> tail; // Next slot to push
+		char padding[64]; // Producers contend on tail, keep them off the consumer's line
+		size_t head; // Next slot to pop
+	};
+
+	template<typename T>
+	MPSCQueue<T>::MPSCQueue(size_t capacity) : tail(0), head(0){
+		size_t size = 1;
+		while(size < capacity) size <<= 1;
+
+		cells.reset(new Cell[size]);
+		for(size_t i = 0; i < size; i++){
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+		mask = size - 1;
+	}
+
+	template<typename T>
+	bool MPSCQueue<T>::push(const T& item){
+		size_t position = tail.load(std::memory_order_relaxed);
+
+		while(true){
+			Cell& cell = cells[position & mask];
+			const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+			const intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+			if(difference == 0){
+				// The slot is free, claim it
+				if(tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)){
+					cell.item = item;
+					cell.sequence.store(position + 1, std::memory_order_release);
+					return true;
+				}
+			}else if(difference < 0){
+				// Not popped since the last lap
+				return false;
+			}else{
+				position = tail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	template<typename T>
+	bool MPSCQueue<T>::pop(T& item){
+		Cell& cell = cells[head & mask];
+		if(cell.sequence.load(std::memory_order_acquire) != head + 1) return false;
+
+		item = cell.item;
+		// Free the slot for the producers' next lap
+		cell.sequence.store(head + mask + 1, std::memory_order_release);
+		head++;
+		return true;
+	}
+
+	template<typename T>
+	bool MPSCQueue<T>::empty() const{
+		return cells[head & mask].sequence.load(std::memory_order_acquire) != head + 1;
+	}
+
+	template<typename T>
+	size_t MPSCQueue<T>::getCapacity() const{
+		return mask + 1;
+	}
+
+	// An event with the playback time it was due at
+	struct TimedEvent{
+		Event event;
+		timestamp_t time;
+	};
+
+	// An event with the sample it falls on, counted from the start of its audio block
+	struct BlockEvent{
+		Event event;
+		uint32_t offset;
+	};
+
+	// Durations in nanoseconds
+	struct PlaybackStats{
+		uint64_t events;
+
+		// How long after its deadline each event was dispatched
+		uint64_t latenessP50;
+		uint64_t latenessP99;
+		uint64_t latenessMax;
+
+		// Time spent in callbacks per event
+		uint64_t callbackP50;
+		uint64_t callbackP99;
+		uint64_t callbackMax;
+	};
+
 	class MIDIPlayer{
 	public:
-		MIDIPlayer(const MIDI& midiObject);	
-
-		void registerEventCallback(TrackEventType, std::function<void(Event)>);	
+		// The MIDI must outlive the player and not be reloaded while it plays
+		MIDIPlayer(const MIDI& midiObject);
+		// Keeps the snapshot alive for as long as it plays, throws std::invalid_argument if it's null
+		MIDIPlayer(std::shared_ptr<const MIDI> snapshot);
+		~MIDIPlayer();
+
+		void registerEventCallback(TrackEventType, EventCallback);	
+		void registerEventCallback(TrackEventType, TimedEventCallback);
+		// Called once per tick by play and advanceTo, after the event callbacks of its last event
+		void registerBatchCallback(BatchCallback);
 		void play();
+		// Only calls the batch callbacks, skipping the per event lookup and calls
+		//	Injected events, which aren't part of a tick, each come as a batch of their own at their time
+		void playBatches();
+
+		// Dispatches every event due by now without blocking, for driving playback from an external loop
+		//	Times are microseconds on the caller's clock, the first call starts the timeline at now
+		//	Returns the next deadline, or NO_DEADLINE once playback has ended
+		int64_t advanceTo(int64_t now);
+		// advanceTo calling only the batch callbacks, as playBatches does
+		int64_t advanceBatchesTo(int64_t now);
+		// Deadline returned by the last advanceTo
+		int64_t getNextDeadline() const;
+
+		// Plays on a new timing thread that queues due events instead of calling callbacks,
+		//	so slow consumers can't delay the schedule. Events are dropped if the queue is full
+		void start(size_t queueCapacity = 1024);
+		// Waits for the timing thread to finish
+		void join();
+		// False once the timing thread has queued its last event
+		bool isRunning() const;
+
+		// Consumer side of start(), call from a single thread
+		bool poll(TimedEvent& event);
+		// Calls the registered callbacks for every queued event, returns how many there were
+		size_t dispatchQueued();
+		uint64_t getDroppedEvents() const;
+
+		// Writes the events falling in the next block of frames to out, returns how many there were
+		//	Blocks follow each other, the first starts the timeline. Events past capacity are dropped
+		//	Doesn't allocate or lock, so it can be called from an audio callback
+		size_t render(uint32_t frames, uint32_t sampleRate, BlockEvent* out, size_t capacity);
 
 		void setTempo(uint32_t msPerBeat);
 
+		// Sleep until this long before each deadline then busy wait the rest, for sub-100us accuracy
+		void setSpinThreshold(std::chrono::microseconds threshold);
+
+		// Run the timeline without sleeping, for offline rendering as fast as possible
+		void setVirtualClock(bool enabled);
+
+		// Transport controls are thread safe, the playing thread picks them up within about a millisecond
+		void pause();
+		void resume();
+		bool isPaused() const;
+		// Ends the current, or else the next, playback
+		void stop();
+
+		// A binary search per track, O(tracks * log n)
+		//	Seeking while stopped takes effect when playback next starts
+		void seekToTick(event_delta_t tick);
+		void seekToTime(timestamp_t time);
+
+		// Jumps back to start whenever playback crosses end
+		void setLoop(event_delta_t start, event_delta_t end);
+		void clearLoop();
+
+		// Switches to another snapshot once playback reaches the tick, or right away if it already has
+		//	Playback carries on from the tick in the new snapshot without a gap. The latest swap wins
+		//	Chasing is turned off since the channel state index belongs to the old snapshot
+		//	The replaced snapshot is released by the next swapAt or the player's destructor, never the playing thread
+		//	Throws std::invalid_argument if the snapshot is null
+		void swapAt(std::shared_ptr<const MIDI> snapshot, event_delta_t tick);
+
+		// After each seek or loop, dispatch events restoring every channel's state at the new position
+		//	The index must outlive the player, nullptr disables chasing
+		void setChannelStateIndex(const ChannelStateIndex* index);
+
+		// Lets other threads inject live events, call before playback starts
+		void enableInjection(size_t capacity = 1024);
+		// Plays the event at the given playback time, merged with the file's events. Lock-free, from any thread
+		//	Late events play right away. A sleeping player picks them up within a poll slice
+		//	Returns false when capacity events are already waiting to play or injection isn't enabled
+		bool inject(const Event& event, timestamp_t time);
+
+		// Bit n mutes or solos channel n, or track n for the first 64 tracks. Can be called from any thread
+		//	While any solo bit is set only soloed channels or tracks play. Tempo changes still apply when muted
+		void setChannelMute(uint16_t mask);
+		void setChannelSolo(uint16_t mask);
+		void setTrackMute(uint64_t mask);
+		void setTrackSolo(uint64_t mask);
+		// Any track of the snapshot the player was created with, tracks past those stay silent while any track is soloed
+		void setTrackMuted(uint32_t track, bool muted);
+		void setTrackSoloed(uint32_t track, bool soloed);
+
+		// Position on the playback timeline
+		timestamp_t getTime() const;
+
+		// Record dispatch lateness and callback cost of every event, set before playing
+		void setInstrumentation(bool enabled);
+		// Can be read from any thread during playback
+		PlaybackStats getStats() const;
+
+		// Applied to the playing thread each time playback starts, set before playing
+		//	Its scheduling policy and affinity are restored when playback returns, memory stays locked
+		//	Options that fail, usually for lack of privileges or a CPU outside cpu_set_t, are skipped
+		void setRealtime(uint32_t options, int priority = 80, int cpu = 0);
+		// RealtimeOptions that took effect the last time playback started, can be read from any thread
+		uint32_t getRealtimeApplied() const;
+
 		bool done();
+
+	protected:
+		// Playback loop, dispatch is called with each event once its time has come
+		template<typename Dispatch>
+		void playWith(Dispatch&& dispatch);
+
+		// Dispatches every event due by now without blocking, returns the next deadline
+		//	Times are microseconds on the caller's clock, the first step starts the timeline at now
+		template<typename Dispatch>
+		int64_t stepWith(int64_t now, Dispatch&& dispatch);
+
 	private:
+		template<typename Dispatch>
+		void dispatchNextEvent(Dispatch& dispatch);
+		// Events on the tick being played are dispatched together without checking the clock
+		bool nextIsSameTick();
+		void callCallbacks(const Event& event);
+		void callBatchCallbacks(const Event& event);
+
+		// Chased channel state first, then the earliest track event
+		const Event& takeNextEvent();
 		const Event& getNextEvent();
+		const Event& peekNextEvent() const;
+
+		// Applies transport requests and waits until the next event is due
+		//	Returns false once playback should end or, when stepping, if nothing is due yet
+		bool prepareNextEvent();
+
+		// Blocks until the deadline unless stepping, returns false if it hasn't been reached
+		bool reached(int64_t deadline);
+		// Returns false if woken early by a transport request
+		bool waitUntil(int64_t deadline) const;
+		bool transportPending() const;
+
+		// Player clock in microseconds, the steady clock or the time of the current step
+		int64_t now() const;
+
+		timestamp_t getTimeOfTick(event_delta_t tick) const;
+		void advanceTimeline(event_delta_t tick);
+
+		// Moves every track to its first event at or after tick and restarts the timeline there
+		void moveTo(event_delta_t tick);
+		void rebuildHeap();
+
+		void recordDispatch(std::chrono::steady_clock::time_point dispatched);
 
 		bool trackIsDone(int trackNum) const;
 		const Event& getNextEventOfTrack(int trackNum) const;
 
+		// Heap order, the track whose next event is earliest (then lowest track number) is on top
+		bool trackIsLater(uint32_t a, uint32_t b) const;
+
 		uint32_t msPerBeat = 500000;
 		event_delta_t currentTick = 0;
+
+		// Exact timeline, the remainder carries the fraction of a microsecond lost to division
+		timestamp_t currentTime = 0;
+		uint64_t timeRemainder = 0;
+
+		int64_t startTime = 0; // Player clock time of timeline zero
+		std::chrono::microseconds spinThreshold{0};
+		bool virtualClock = false;
+
+		bool stepping = false;
+		int64_t stepTime = 0;
+		int64_t nextDeadline = NO_DEADLINE;
+
+		uint64_t renderedFrames = 0;
+		uint32_t renderSampleRate = 0;
+
+		static constexpr int64_t NO_SEEK = -1;
+		static constexpr int64_t SEEK_TIME = int64_t(1) << 62; // Set when a seek request holds a time, not a tick
+
+		// Requests from any thread
+		std::atomic<bool> paused{false};
+		std::atomic<bool> stopRequested{false};
+		std::atomic<int64_t> seekRequest{NO_SEEK};
+		std::atomic<uint64_t> loopRegion{0}; // start << 32 | end, 0 when not looping
+
+		// Per track arrays and the batch, sized for one MIDI
+		//	Swaps build them on the calling thread, so the playing thread only exchanges them with its own
+		struct TrackBindings{
+			explicit TrackBindings(const MIDI& midiObject);
+
+			std::vector<size_t> nextEvents;
+			std::vector<const Event*> trackEvents;
+			std::vector<size_t> trackEnds;
+			std::vector<uint32_t> trackHeap;
+			std::vector<Event> batch;
+		};
+		void swapBindings(TrackBindings& bindings);
+
+		// Swaps are handed over whole, the playing thread takes ownership by exchanging the pointer with nullptr
+		struct SwapRequest{
+			std::shared_ptr<const MIDI> snapshot;
+			event_delta_t tick;
+			SwapRequest* next; // In the retired list
+			TrackBindings bindings; // Leaves holding the old snapshot's
+		};
+		std::atomic<SwapRequest*> swapRequest{nullptr};
+		// Taken or replaced snapshots, freed by swapAt so the playing thread never releases a MIDI
+		std::atomic<SwapRequest*> retiredSwaps{nullptr};
+		SwapRequest* pendingSwap = nullptr; // Playing thread only
+		void takeSwapRequest();
+		void applySwap(event_delta_t tick, timestamp_t swapTime);
+		void retire(SwapRequest* request);
+		static void freeSwaps(SwapRequest* list);
+
+		// Injected events are drained into a heap ordered by time. At most the queue's capacity
+		//	are waiting in both together, so a drain always empties the queue without allocating
+		std::unique_ptr<MPSCQueue<TimedEvent>> injectQueue;
+		std::atomic<size_t> injectedWaiting{0};
+		std::vector<TimedEvent> injected;
+		TimedEvent injectedEvent;
+		bool injectedDue = false;
+		void drainInjected();
+
+		// Playing thread's side of pause
+		bool pauseApplied = false;
+		timestamp_t pausePosition = 0;
+
+		const ChannelStateIndex* channelStateIndex = nullptr;
+		std::vector<Event> chaseEvents;
+		size_t chasePosition = 0;
+
+		// Set under maskMutex, which also serialises updates to the effective masks
+		std::mutex maskMutex;
+		uint16_t channelMute = 0;
+		uint16_t channelSolo = 0;
+		std::vector<uint64_t> trackMute; // 64 tracks a word
+		std::vector<uint64_t> trackSolo;
+		void updateMasks();
+
+		// Effective masks, a set bit plays
+		std::atomic<uint16_t> channelMask{0xFFFF};
+		std::unique_ptr<std::atomic<uint64_t>[]> trackMask;
+		size_t trackWords;
+		std::atomic<bool> trackSoloActive{false};
+		uint32_t eventTrack = NO_TRACK; // Track of the event being dispatched
+		timestamp_t eventTime = 0; // and the time it was due at
+		bool eventInjected = false; // Injected events aren't part of a tick
+		static constexpr uint32_t NO_TRACK = ~uint32_t(0);
+		bool isAudible(const Event& event) const;
+		void addToBatch(const Event& event);
+		void flushBatch();
+
+		struct Instrumentation{
+			LatencyHistogram lateness;
+			LatencyHistogram callback;
+		};
+		std::unique_ptr<Instrumentation> instrumentation;
+
+		uint32_t realtimeOptions = REALTIME_NONE;
+		int realtimePriority = 0;
+		int realtimeCPU = 0;
+		std::atomic<uint32_t> realtimeApplied{REALTIME_NONE};
+		void applyRealtime();
+		void restoreRealtime();
+		struct SavedThreadState;
+		std::unique_ptr<SavedThreadState> savedThreadState; // The playing thread's settings before applyRealtime
 	
-		std::unordered_map<TrackEventType, std::vector<std::function<void(Event)>>> eventCallbacks;
+		// Either kind of callback, so plain ones are called directly rather than through a timed wrapper
+		struct Callback{
+			EventCallback plain;
+			TimedEventCallback timed;
+
+			void operator()(const Event& event, timestamp_t time) const{
+				if(plain) plain(event);
+				else timed(event, time);
+			}
+		};
+		std::vector<Callback> eventCallbacks[256]; // Indexed by TrackEventType
+		std::vector<BatchCallback> batchCallbacks;
+		std::vector<Event> batch; // Reused, holds the events of the current tick
 		std::vector<size_t> nextEvents;
+		// Per track event array and the index its playable events end at, TRACK_END isn't played
+		std::vector<const Event*> trackEvents;
+		std::vector<size_t> trackEnds;
+
+		std::thread timingThread;
+		std::unique_ptr<SPSCQueue<TimedEvent>> outputQueue;
+		std::atomic<bool> running{false};
+		std::atomic<uint64_t> droppedEvents{0};
+
+		std::vector<uint32_t> trackHeap; // Unfinished tracks only, so its size is the active track count
+
+		const MIDI* midi;
+		std::shared_ptr<const MIDI> snapshot;
+	};
+
+	template<typename Dispatch>
+	void MIDIPlayer::playWith(Dispatch&& dispatch){
+		running = true;
+
+		if(realtimeOptions) applyRealtime();
+
+		// Deadlines are absolute so sleep overshoot never accumulates
+		startTime = now() - currentTime;
+
+		while(prepareNextEvent()){
+			do{
+				dispatchNextEvent(dispatch);
+			}while(nextIsSameTick());
+		}
+
+		if(realtimeOptions) restoreRealtime();
+
+		stopRequested = false;
+		running = false;
+	}
+
+	template<typename Dispatch>
+	int64_t MIDIPlayer::stepWith(int64_t now, Dispatch&& dispatch){
+		if(!stepping){
+			stepping = true;
+			running = true;
+			startTime = now - currentTime;
+		}
+		stepTime = now;
+
+		while(prepareNextEvent()){
+			do{
+				dispatchNextEvent(dispatch);
+			}while(nextIsSameTick());
+		}
 
-		const MIDI& midi;
+		if(nextDeadline == NO_DEADLINE){
+			stepping = false;
+			stopRequested = false;
+			running = false;
+		}
+
+		return nextDeadline;
+	}
+
+	template<typename Dispatch>
+	void MIDIPlayer::dispatchNextEvent(Dispatch& dispatch){
+		const Event& nextEvent = takeNextEvent();
+
+		if(nextEvent.getType() == SET_TEMPO){
+			setTempo(nextEvent.getData().tempo.msPerBeat);
+		}
+
+		if(!isAudible(nextEvent)){
+			// The tick's batch may have been waiting on this event
+			if(!batch.empty() && !nextIsSameTick()) flushBatch();
+			return;
+		}
+
+		if(instrumentation){
+			const auto dispatched = std::chrono::steady_clock::now();
+			dispatch(nextEvent);
+			recordDispatch(dispatched);
+		}else{
+			dispatch(nextEvent);
+		}
+	}
+
+	// Tag selecting a StaticMIDIPlayer handler overload,
+	//	eg. void operator()(EventTag<NOTE_ON>, const Event& event)
+	template<TrackEventType Type>
+	struct EventTag{};
+
+	// Player with a fixed set of handlers known at compile time
+	//	Each event type only calls the handlers with an overload for its tag, directly and inlinable,
+	//	types no handler accepts compile away entirely
+	//	Everything of MIDIPlayer but its callbacks is available, the threaded start and poll
+	//	hand events to a consumer rather than the handlers so aren't either
+	template<typename... Handlers>
+	class StaticMIDIPlayer : private MIDIPlayer{
+	public:
+		StaticMIDIPlayer(const MIDI& midiObject, Handlers... handlers) : MIDIPlayer(midiObject), handlers(handlers...){
+		}
+		StaticMIDIPlayer(std::shared_ptr<const MIDI> snapshot, Handlers... handlers) : MIDIPlayer(std::move(snapshot)), handlers(handlers...){
+		}
+
+		void play(){
+			playWith([this](const Event& event){
+				dispatch(event);
+			});
+		}
+
+		int64_t advanceTo(int64_t now){
+			return stepWith(now, [this](const Event& event){
+				dispatch(event);
+			});
+		}
+
+		using MIDIPlayer::getNextDeadline;
+		using MIDIPlayer::render;
+		using MIDIPlayer::setTempo;
+		using MIDIPlayer::setSpinThreshold;
+		using MIDIPlayer::setVirtualClock;
+		using MIDIPlayer::done;
+		using MIDIPlayer::pause;
+		using MIDIPlayer::resume;
+		using MIDIPlayer::isPaused;
+		using MIDIPlayer::stop;
+		using MIDIPlayer::seekToTick;
+		using MIDIPlayer::seekToTime;
+		using MIDIPlayer::setLoop;
+		using MIDIPlayer::clearLoop;
+		using MIDIPlayer::swapAt;
+		using MIDIPlayer::setChannelStateIndex;
+		using MIDIPlayer::enableInjection;
+		using MIDIPlayer::inject;
+		using MIDIPlayer::setChannelMute;
+		using MIDIPlayer::setChannelSolo;
+		using MIDIPlayer::setTrackMute;
+		using MIDIPlayer::setTrackSolo;
+		using MIDIPlayer::setTrackMuted;
+		using MIDIPlayer::setTrackSoloed;
+		using MIDIPlayer::getTime;
+		using MIDIPlayer::setInstrumentation;
+		using MIDIPlayer::getStats;
+		using MIDIPlayer::setRealtime;
+		using MIDIPlayer::getRealtimeApplied;
+
+		template<size_t I>
+		typename std::tuple_element<I, std::tuple<Handlers...>>::type& getHandler(){
+			return std::get<I>(handlers);
+		}
+
+	private:
+		void dispatch(const Event& event){
+			switch(event.getType()){
+			case SEQ_NUM: dispatchAs<SEQ_NUM>(event); break;
+			case TEXT_EVENT: dispatchAs<TEXT_EVENT>(event); break;
+			case COPYRIGHT: dispatchAs<COPYRIGHT>(event); break;
+			case TRACK_NAME: dispatchAs<TRACK_NAME>(event); break;
+			case INSTRUMENT_NAME: dispatchAs<INSTRUMENT_NAME>(event); break;
+			case LYRIC: dispatchAs<LYRIC>(event); break;
+			case TEXT_MARKER: dispatchAs<TEXT_MARKER>(event); break;
+			case CUE_POINT: dispatchAs<CUE_POINT>(event); break;
+			case CHANNEL_PREFIX: dispatchAs<CHANNEL_PREFIX>(event); break;
+			case TRACK_END: dispatchAs<TRACK_END>(event); break;
+			case SET_TEMPO: dispatchAs<SET_TEMPO>(event); break;
+			case TIME_SIGNATURE: dispatchAs<TIME_SIGNATURE>(event); break;
+			case NOTE_OFF: dispatchAs<NOTE_OFF>(event); break;
+			case NOTE_ON: dispatchAs<NOTE_ON>(event); break;
+			case POLY: dispatchAs<POLY>(event); break;
+			case CONTROLLER: dispatchAs<CONTROLLER>(event); break;
+			case PROGRAM: dispatchAs<PROGRAM>(event); break;
+			case CHANNEL_PRESSURE: dispatchAs<CHANNEL_PRESSURE>(event); break;
+			case PITCH_BEND_CHANGE: dispatchAs<PITCH_BEND_CHANGE>(event); break;
+			case SYS_EX: dispatchAs<SYS_EX>(event); break;
+			case MTC_QTR_FRAME: dispatchAs<MTC_QTR_FRAME>(event); break;
+			case SONG_POS_POINTER: dispatchAs<SONG_POS_POINTER>(event); break;
+			case SONG_SELECT: dispatchAs<SONG_SELECT>(event); break;
+			case TUNE_REQUEST: dispatchAs<TUNE_REQUEST>(event); break;
+			case EO_SYS_EX: dispatchAs<EO_SYS_EX>(event); break;
+			case TIMING_CLOCK: dispatchAs<TIMING_CLOCK>(event); break;
+			case START: dispatchAs<START>(event); break;
+			case CONTINUE: dispatchAs<CONTINUE>(event); break;
+			case STOP: dispatchAs<STOP>(event); break;
+			case ACTIVE_SENSING: dispatchAs<ACTIVE_SENSING>(event); break;
+			case META: dispatchAs<META>(event); break;
+			}
+		}
+
+		template<TrackEventType Type>
+		void dispatchAs(const Event& event){
+			dispatchAs<Type>(event, std::index_sequence_for<Handlers...>());
+		}
+
+		template<TrackEventType Type, size_t... I>
+		void dispatchAs(const Event& event, std::index_sequence<I...>){
+			// Calls every handler in order
+			const int expand[] = {0, (invoke<Type>(std::get<I>(handlers), event, 0), 0)...};
+			(void)expand;
+		}
+
+		// Preferred through the int argument when the handler has an overload for the tag
+		template<TrackEventType Type, typename Handler>
+		static auto invoke(Handler& handler, const Event& event, int) -> decltype(handler(EventTag<Type>(), event), void()){
+			handler(EventTag<Type>(), event);
+		}
+
+		template<TrackEventType Type, typename Handler>
+		static void invoke(Handler&, const Event&, long){
+		}
+
+		std::tuple<Handlers...> handlers;
+	};
+
+	// Plays many players on a few threads, each thread keeps its players on a hierarchical timing wheel
+	//	Events are dispatched on the first wheel tick at or after their time, so up to one resolution late
+	//	Players must not be played elsewhere and must outlive their playback
+	class PlayerScheduler{
+	public:
+		PlayerScheduler(size_t threads, std::chrono::microseconds resolution = std::chrono::milliseconds(1));
+		~PlayerScheduler();
+
+		// Starts the player from its current position on the least loaded thread
+		void add(MIDIPlayer& player);
+
+		// Blocks until every added player has finished
+		void wait();
+
+		size_t getActivePlayers() const;
+
+	private:
+		static constexpr uint32_t wheelBits = 6;
+		static constexpr uint32_t wheelSlots = 1 << wheelBits;
+		static constexpr uint32_t wheelLevels = 4;
+
+		struct Entry{
+			MIDIPlayer* player;
+			uint64_t due; // Wheel tick
+		};
+
+		struct Shard{
+			std::thread thread;
+			std::mutex mutex;
+			std::condition_variable wake;
+			std::vector<MIDIPlayer*> pending;
+			std::atomic<size_t> players{0};
+
+			// Only touched by the shard's thread
+			std::vector<Entry> wheel[wheelLevels][wheelSlots];
+			uint64_t currentTick = 0;
+			size_t scheduled = 0;
+		};
+
+		void run(Shard& shard);
+		void step(Shard& shard, MIDIPlayer* player, int64_t now);
+		void schedule(Shard& shard, const Entry& entry);
+		void advance(Shard& shard, uint64_t tick, std::vector<MIDIPlayer*>& due);
+
+		const int64_t resolution;
+		std::vector<std::unique_ptr<Shard>> shards;
+		std::atomic<bool> stopping{false};
+
+		mutable std::mutex idleMutex;
+		std::condition_variable idle;
+		size_t activePlayers = 0;
 	};
 }
 
@@ -223,13 +1278,16 @@ namespace midi{
 
 #include <iostream>
 #include <arpa/inet.h> // for endian detection
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 
 namespace midi{
 	namespace{
 		const char* midiHeaderMagic = "MThd";
 		const char* midiTrackMagic = "MTrk";
 
-		constexpr bool isBigEndian = htonl(47) == 47;
+		const bool isBigEndian = htonl(47) == 47;
 
 		uint16_t swapEndian(uint16_t n){
 			return (n >> 8) | (n << 8);
@@ -281,33 +1339,240 @@ namespace midi{
 			return !std::memcmp(magicBuffer, midiHeaderMagic, 4);
 		}
 
-	}
+		const int32_t NONE = -1;
 
-	// Header
-	TrackFormat Header::getType() const{
-		return type;
-	}
+		// How often a sleeping player checks for pause, stop and seek
+		const std::chrono::microseconds transportPollInterval(1000);
 
-	uint16_t Header::getNumTracks() const{
-		return numTracks;
-	}
+		bool injectedIsLater(const TimedEvent& a, const TimedEvent& b){
+			return a.time > b.time;
+		}
 
-	uint16_t Header::getTicksPerBeat() const{
-		return ticksPerBeat;
-	}
+		int64_t steadyMicros(){
+			return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
 
-	void Header::swapEndian(){
-		if(!isBigEndian){
-			type = (TrackFormat)((type >> 8) | (type << 8));
-			numTracks = (numTracks >> 8) | (numTracks << 8);
-			ticksPerBeat = (ticksPerBeat >> 8) | (ticksPerBeat << 8);	
+		const std::shared_ptr<const MIDI>& checkSnapshot(const std::shared_ptr<const MIDI>& snapshot){
+			if(!snapshot) throw std::invalid_argument("MIDIPlayer: null snapshot");
+			return snapshot;
 		}
-	}
 
-	// Event
-	const Event::EventData& Event::getData() const{
-		return eventData;
-	}
+		// Pairs note ons and offs of one track in a single pass
+		//	Open notes form per channel/pitch stacks threaded through the output, so the only
+		//	allocations are the output itself and one link per note
+		class NotePairer{
+			public:
+			NotePairer(std::vector<Note>& out, uint32_t options) : out(out), options(options){
+			}
+
+			void pairTrack(const Track& track, uint16_t trackNum){
+				std::fill(&open[0][0], &open[0][0] + 16*128, NONE);
+				std::fill(held, held + 16, NONE);
+				std::fill(pedal, pedal + 16, false);
+				link.clear();
+				first = out.size();
+
+				for(const Event& event : track.getEvents()){
+					const channel_t channel = event.getChannel() & 0x0F;
+
+					switch(event.getType()){
+					case NOTE_ON:
+						if(event.getData().note.velocity != 0){
+							noteOn(event, channel, trackNum);
+							break;
+						}
+						// Zero velocity note on is a note off
+						// fallthrough
+					case NOTE_OFF:
+						noteOff(event, channel);
+						break;
+					case CONTROLLER:
+						if((options & PAIR_SUSTAIN) && event.getData().controller.function == 64){
+							sustain(event, channel);
+						}
+						break;
+					default:
+						break;
+					}
+				}
+
+				// Dangling and still sustained notes end with the track
+				const event_delta_t lastTick = track.getEvents().empty() ? 0 : track.getEvents().back().getTick();
+				for(int channel = 0; channel < 16; channel++){
+					for(int pitch = 0; pitch < 128; pitch++){
+						endAll(open[channel][pitch], lastTick);
+					}
+					endAll(held[channel], lastTick);
+				}
+			}
+
+			private:
+			void noteOn(const Event& event, channel_t channel, uint16_t trackNum){
+				const unsigned char pitch = event.getData().note.note & 0x7F;
+
+				// Restriking a sustained pitch cuts the ringing note off
+				if(pedal[channel]){
+					for(int32_t* note = &held[channel]; *note != NONE; note = &link[*note - first]){
+						if(out[*note].pitch == pitch){
+							out[*note].end = event.getTick();
+							*note = link[*note - first];
+							break;
+						}
+					}
+				}
+
+				out.push_back(Note{event.getTick(), event.getTick(), trackNum, channel, pitch, (unsigned char)event.getData().note.velocity});
+				link.push_back(open[channel][pitch]);
+				open[channel][pitch] = out.size() - 1;
+			}
+
+			void noteOff(const Event& event, channel_t channel){
+				int32_t& top = open[channel][event.getData().note.note & 0x7F];
+				if(top == NONE) return; // Stray note off
+
+				const int32_t note = top;
+				top = link[note - first];
+
+				if(pedal[channel]){
+					link[note - first] = held[channel];
+					held[channel] = note;
+				}else{
+					out[note].end = event.getTick();
+				}
+			}
+
+			void sustain(const Event& event, channel_t channel){
+				pedal[channel] = event.getData().controller.value >= 64;
+
+				if(!pedal[channel]){
+					endAll(held[channel], event.getTick());
+				}
+			}
+
+			void endAll(int32_t& list, event_delta_t tick){
+				for(int32_t note = list; note != NONE; note = link[note - first]){
+					out[note].end = tick;
+				}
+				list = NONE;
+			}
+
+			std::vector<Note>& out;
+			const uint32_t options;
+
+			size_t first; // Index in out of the current track's first note
+			std::vector<int32_t> link; // Next note down the stack, per note of the current track
+
+			int32_t open[16][128];
+			int32_t held[16]; // Released while the pedal is down
+			bool pedal[16];
+		};
+
+	}
+
+	// Header
+	TrackFormat Header::getType() const{
+		return type;
+	}
+
+	uint16_t Header::getNumTracks() const{
+		return numTracks;
+	}
+
+	uint16_t Header::getTicksPerBeat() const{
+		return ticksPerBeat;
+	}
+
+	void Header::swapEndian(){
+		if(!isBigEndian){
+			type = (TrackFormat)midi::swapEndian((uint16_t)type);
+			numTracks = midi::swapEndian(numTracks);
+			ticksPerBeat = midi::swapEndian(ticksPerBeat);
+		}
+	}
+
+	namespace{
+		// Keeps entries sorted by tick, an entry already on the tick is replaced instead
+		//	Then brings each later entry up to date with the one before it
+		template<typename Entry, typename Replace, typename Follow>
+		void insertByTick(std::vector<Entry>& entries, const Entry& entry, Replace replace, Follow follow){
+			auto it = std::lower_bound(entries.begin(), entries.end(), entry.tick, [](const Entry& e, event_delta_t t){
+				return e.tick < t;
+			});
+
+			if(it != entries.end() && it->tick == entry.tick){
+				replace(*it, entry);
+			}else{
+				it = entries.insert(it, entry);
+			}
+
+			// Entries normally arrive in order, so this only touches the new one
+			for(it = std::max(it, entries.begin() + 1); it != entries.end(); it++){
+				follow(*(it - 1), *it);
+			}
+		}
+	}
+
+	// TempoMap
+	timestamp_t TempoMap::tickToMicros(event_delta_t tick) const{
+		auto change = std::upper_bound(changes.begin(), changes.end(), tick, [](event_delta_t t, const TempoChange& c){
+			return t < c.tick;
+		}) - 1;
+
+		return change->micros + (timestamp_t)(tick - change->tick) * change->usPerBeat / ticksPerBeat;
+	}
+
+	event_delta_t TempoMap::microsToTick(timestamp_t micros) const{
+		auto change = std::upper_bound(changes.begin(), changes.end(), micros, [](timestamp_t t, const TempoChange& c){
+			return t < c.micros;
+		}) - 1;
+
+		return change->tick + (micros - change->micros) * ticksPerBeat / change->usPerBeat;
+	}
+
+	uint32_t TempoMap::getTempoAt(event_delta_t tick) const{
+		return (std::upper_bound(changes.begin(), changes.end(), tick, [](event_delta_t t, const TempoChange& c){
+			return t < c.tick;
+		}) - 1)->usPerBeat;
+	}
+
+	const std::vector<TempoMap::TempoChange>& TempoMap::getChanges() const{
+		return changes;
+	}
+
+	uint32_t TempoMap::getRevision() const{
+		return revision;
+	}
+
+	void TempoMap::reset(uint16_t ticksPerBeat){
+		this->ticksPerBeat = ticksPerBeat;
+		changes.assign(1, TempoChange{0, 0, 500000});
+		revision++;
+	}
+
+	void TempoMap::addChange(event_delta_t tick, uint32_t usPerBeat){
+		insertByTick(changes, TempoChange{tick, 0, usPerBeat}, [](TempoChange& change, const TempoChange& replacement){
+			change.usPerBeat = replacement.usPerBeat;
+		}, [this](const TempoChange& prev, TempoChange& change){
+			change.micros = prev.micros + (timestamp_t)(change.tick - prev.tick) * prev.usPerBeat / ticksPerBeat;
+		});
+
+		revision++;
+	}
+
+	// Event
+	Event::Event(TrackEventType type, channel_t channel, unsigned char data1, unsigned char data2, event_delta_t tick)
+		: tickDelta(0), tick(tick), type(type), channel(channel){
+		eventData.tempo.msPerBeat = 0;
+
+		// Every channel event keeps its data bytes at the start of the union
+		unsigned char* data = (unsigned char*)&eventData;
+		data[0] = data1;
+		data[1] = data2;
+	}
+
+	const Event::EventData& Event::getData() const{
+		return eventData;
+	}
 
 
 	event_delta_t Event::getTickDelta() const{
@@ -377,6 +1642,17 @@ namespace midi{
 						eventData.tempo.msPerBeat |= length[2-i]<<(i*8);
 					}
 					break;
+				case TIME_SIGNATURE:{
+					const uint32_t argLength = std::min<uint32_t>(metaLength, 4);
+
+					eventData.timeSignature = {4, 2, 24, 8};
+					inputfile.read((char*)&eventData.timeSignature, argLength);
+					inputfile.seekg(metaLength - argLength, std::ios::cur);
+
+					// Beats are found by shifting by the exponent, anything past 31 can't be shifted by
+					eventData.timeSignature.denominator = std::min<unsigned char>(eventData.timeSignature.denominator, 31);
+					break;
+				}
 				default:
 					inputfile.seekg(metaLength, std::ios::cur);
 					break;
@@ -406,6 +1682,187 @@ namespace midi{
 		return pow(2, (note-69)/12.0f) * 440.0f;
 	}
 
+	// EventRange
+	EventRange::EventRange(const Event* first, const Event* last) : first(first), last(last){
+	}
+
+	const Event* EventRange::begin() const{
+		return first;
+	}
+
+	const Event* EventRange::end() const{
+		return last;
+	}
+
+	size_t EventRange::size() const{
+		return last - first;
+	}
+
+	bool EventRange::empty() const{
+		return first == last;
+	}
+
+	// BarMap
+	BarMap::Position BarMap::tickToPosition(event_delta_t tick) const{
+		const Segment& segment = *(std::upper_bound(segments.begin(), segments.end(), tick, [](event_delta_t t, const Segment& s){
+			return t < s.tick;
+		}) - 1);
+
+		const event_delta_t offset = tick - segment.tick;
+		const event_delta_t offsetInBar = offset % segment.ticksPerBar;
+
+		return Position{
+			segment.bar + offset / segment.ticksPerBar,
+			offsetInBar / segment.ticksPerBeat,
+			offsetInBar % segment.ticksPerBeat
+		};
+	}
+
+	event_delta_t BarMap::positionToTick(const Position& position) const{
+		const Segment& segment = getSegmentOfBar(position.bar);
+
+		return segment.tick + (position.bar - segment.bar) * segment.ticksPerBar
+			+ position.beat * segment.ticksPerBeat + position.tickInBeat;
+	}
+
+	event_delta_t BarMap::getBarStart(uint32_t bar) const{
+		const Segment& segment = getSegmentOfBar(bar);
+
+		return segment.tick + (bar - segment.bar) * segment.ticksPerBar;
+	}
+
+	const BarMap::Segment& BarMap::getSegmentOfBar(uint32_t bar) const{
+		return *(std::upper_bound(segments.begin(), segments.end(), bar, [](uint32_t b, const Segment& s){
+			return b < s.bar;
+		}) - 1);
+	}
+
+	const std::vector<BarMap::Segment>& BarMap::getSegments() const{
+		return segments;
+	}
+
+	BarMap::Segment BarMap::makeSegment(event_delta_t tick, unsigned char numerator, unsigned char denominator) const{
+		Segment segment;
+		segment.tick = tick;
+		segment.bar = 0;
+		segment.numerator = numerator;
+		segment.denominator = denominator;
+		segment.ticksPerBeat = std::max<event_delta_t>((ticksPerBeat * 4) >> denominator, 1);
+		segment.ticksPerBar = segment.ticksPerBeat * std::max<unsigned char>(numerator, 1);
+		return segment;
+	}
+
+	void BarMap::reset(uint16_t ticksPerBeat){
+		this->ticksPerBeat = ticksPerBeat;
+		segments.assign(1, makeSegment(0, 4, 2));
+	}
+
+	void BarMap::addTimeSignature(event_delta_t tick, unsigned char numerator, unsigned char denominator){
+		insertByTick(segments, makeSegment(tick, numerator, denominator), [](Segment& segment, const Segment& replacement){
+			const uint32_t bar = segment.bar;
+			segment = replacement;
+			segment.bar = bar;
+		}, [](const Segment& prev, Segment& segment){
+			segment.bar = prev.bar + (segment.tick - prev.tick + prev.ticksPerBar - 1) / prev.ticksPerBar;
+		});
+	}
+
+	// PostingList
+	namespace{
+		uint32_t readVariableLength(const uint8_t*& position){
+			uint32_t length = 0;
+			uint8_t byte;
+
+			do{
+				byte = *position++;
+				length = (length << 7) | (byte & 0b01111111);
+			} while(byte & (1<<7));
+
+			return length;
+		}
+	}
+
+	PostingList::const_iterator::const_iterator(const uint8_t* position, uint32_t base) : position(position), base(base){
+	}
+
+	uint32_t PostingList::const_iterator::operator*() const{
+		const uint8_t* next = position;
+		return base + readVariableLength(next);
+	}
+
+	PostingList::const_iterator& PostingList::const_iterator::operator++(){
+		base += readVariableLength(position);
+		return *this;
+	}
+
+	bool PostingList::const_iterator::operator==(const const_iterator& other) const{
+		return position == other.position;
+	}
+
+	bool PostingList::const_iterator::operator!=(const const_iterator& other) const{
+		return position != other.position;
+	}
+
+	PostingList::const_iterator PostingList::begin() const{
+		return const_iterator(deltas.data(), 0);
+	}
+
+	PostingList::const_iterator PostingList::end() const{
+		return const_iterator(deltas.data() + deltas.size(), last);
+	}
+
+	size_t PostingList::size() const{
+		return count;
+	}
+
+	bool PostingList::empty() const{
+		return count == 0;
+	}
+
+	void PostingList::push_back(uint32_t index){
+		uint32_t delta = index - last;
+
+		// Most significant group first, continuation bit on all but the last byte
+		int shift = 28;
+		while(shift > 0 && (delta >> shift) == 0){
+			shift -= 7;
+		}
+		for(; shift > 0; shift -= 7){
+			deltas.push_back(((delta >> shift) & 0b01111111) | (1<<7));
+		}
+		deltas.push_back(delta & 0b01111111);
+
+		count++;
+		last = index;
+	}
+
+	// EventIndex
+	const PostingList& EventIndex::find(TrackEventType type, channel_t channel) const{
+		static const PostingList empty;
+
+		auto postings = typePostings.find(type | channel);
+		return postings != typePostings.end() ? postings->second : empty;
+	}
+
+	const PostingList& EventIndex::findController(channel_t channel, unsigned char controller) const{
+		static const PostingList empty;
+
+		auto postings = controllerPostings.find(channel << 7 | controller);
+		return postings != controllerPostings.end() ? postings->second : empty;
+	}
+
+	void EventIndex::add(const Event& event, uint32_t index){
+		// Only channel events carry a meaningful channel
+		if(event.getType() < NOTE_OFF || event.getType() >= SYS_EX) return;
+
+		typePostings[event.getType() | event.getChannel()].push_back(index);
+
+		if(event.getType() == CONTROLLER){
+			const unsigned char controller = event.getData().controller.function;
+			controllerPostings[event.getChannel() << 7 | controller].push_back(index);
+		}
+	}
+
 	// Track
 	const std::vector<Event>& Track::getEvents() const{
 		return events;
@@ -415,7 +1872,50 @@ namespace midi{
 		return events.at(index);
 	}
 
-	bool Track::readTrackChunk(std::ifstream& inputFile){
+	const std::vector<timestamp_t>& Track::getTimestamps() const{
+		return timestamps;
+	}
+
+	timestamp_t Track::getTimestamp(int index) const{
+		return timestamps.at(index);
+	}
+
+	EventRange Track::eventsInRange(event_delta_t first, event_delta_t last) const{
+		const auto byTick = [](const Event& e, event_delta_t t){
+			return e.getTick() < t;
+		};
+
+		const Event* begin = events.data();
+		const Event* end = events.data() + events.size();
+
+		const Event* rangeFirst = std::lower_bound(begin, end, first, byTick);
+		const Event* rangeLast = first < last ? std::lower_bound(rangeFirst, end, last, byTick) : rangeFirst;
+
+		return EventRange(rangeFirst, rangeLast);
+	}
+
+	size_t Track::getEventIndexAt(event_delta_t tick) const{
+		return eventsInRange(tick, tick).begin() - events.data();
+	}
+
+	const EventIndex& Track::getIndex() const{
+		return index;
+	}
+
+	std::vector<Note> Track::getNotes(uint32_t options) const{
+		std::vector<Note> notes;
+		NotePairer(notes, options).pairTrack(*this, 0);
+		return notes;
+	}
+
+	void Track::computeTimestamps(const TempoMap& tempoMap){
+		timestamps.resize(events.size());
+		for(size_t i = 0; i < events.size(); i++){
+			timestamps[i] = tempoMap.tickToMicros(events[i].getTick());
+		}
+	}
+
+	bool Track::readTrackChunk(std::ifstream& inputFile, TempoMap& tempoMap, BarMap& barMap, uint32_t options){
 		if(!checkTrackMagic(inputFile)){
 			std::cerr << "Error: no magic string at beginning of track\n";
 			return false;
@@ -433,6 +1933,22 @@ namespace midi{
 			bytesRead += event.readEvent(inputFile, prevTick);
 			prevTick = event.getTick();
 			events.push_back(event);
+
+			// A tempo change only affects later ticks, so this event's time is settled either way
+			if(options & LOAD_TIMESTAMPS){
+				timestamps.push_back(tempoMap.tickToMicros(event.getTick()));
+			}
+
+			if(options & LOAD_INDEX){
+				index.add(event, events.size() - 1);
+			}
+
+			if(event.getType() == SET_TEMPO){
+				tempoMap.addChange(event.getTick(), event.getData().tempo.msPerBeat);
+			}else if(event.getType() == TIME_SIGNATURE){
+				const auto& timeSignature = event.getData().timeSignature;
+				barMap.addTimeSignature(event.getTick(), timeSignature.numerator, timeSignature.denominator);
+			}
 		}
 
 		return true;
@@ -451,12 +1967,18 @@ namespace midi{
 		inputFile.read((char*)&header, sizeof(Header));
 		header.swapEndian();
 
+		// Every tick to time conversion divides by it
+		if(header.getTicksPerBeat() == 0){
+			std::cerr << "Error: header has a division of zero\n";
+			return false;
+		}
+
 		return true;
 	}
 
-	bool MIDI::readTrackChunk(std::ifstream& inputFile){
+	bool MIDI::readTrackChunk(std::ifstream& inputFile, uint32_t options){
 		tracks.push_back(Track());
-		return tracks.back().readTrackChunk(inputFile);
+		return tracks.back().readTrackChunk(inputFile, tempoMap, barMap, options);
 	}
 
 	const Header& MIDI::getHeader() const{
@@ -475,114 +1997,1377 @@ namespace midi{
 		return getTrack(track).getEvent(index);
 	}
 
-	bool MIDI::loadFile(const char* filename){
+	const TempoMap& MIDI::getTempoMap() const{
+		return tempoMap;
+	}
+
+	const BarMap& MIDI::getBarMap() const{
+		return barMap;
+	}
+
+	std::vector<EventRange> MIDI::eventsInRange(event_delta_t first, event_delta_t last) const{
+		std::vector<EventRange> ranges;
+		ranges.reserve(tracks.size());
+
+		for(const Track& track : tracks){
+			ranges.push_back(track.eventsInRange(first, last));
+		}
+
+		return ranges;
+	}
+
+	EventRange MIDI::eventsInBar(int track, uint32_t bar) const{
+		return getTrack(track).eventsInRange(barMap.getBarStart(bar), barMap.getBarStart(bar + 1));
+	}
+
+	std::vector<Note> MIDI::getNotes(uint32_t options) const{
+		std::vector<Note> notes;
+		NotePairer pairer(notes, options);
+
+		for(size_t i = 0; i < tracks.size(); i++){
+			const size_t trackFirst = notes.size();
+			pairer.pairTrack(tracks[i], i);
+
+			// Each track is already sorted, merge it into the ones before it
+			std::inplace_merge(notes.begin(), notes.begin() + trackFirst, notes.end(), [](const Note& a, const Note& b){
+				return a.start < b.start;
+			});
+		}
+
+		return notes;
+	}
+
+	std::shared_ptr<const MIDI> MIDI::loadShared(const char* filename, uint32_t options){
+		std::shared_ptr<MIDI> midi = std::make_shared<MIDI>();
+		if(!midi->loadFile(filename, options)) return nullptr;
+
+		return midi;
+	}
+
+	bool MIDI::loadFile(const char* filename, uint32_t options){
 		std::ifstream input(filename, std::ios::binary);
 		if(!input.is_open()){
 			std::cerr << "Error: could not open file " << filename << "\n";
 			return false;
 		}
 
+		tracks.clear();
+
 		if(!readHeaderChunk(input)){
 			input.close();
 			return false;
 		}
 
+		tempoMap.reset(header.ticksPerBeat);
+		barMap.reset(header.ticksPerBeat);
+
+		// Tempo revision each track was timestamped against
+		std::vector<uint32_t> tempoRevisions;
+
 		for(int i = 0; i < header.numTracks; i++){
-			if(!readTrackChunk(input)){
+			if(!readTrackChunk(input, options)){
 				input.close();
 				return false;
 			}
+
+			tempoRevisions.push_back(tempoMap.getRevision());
+		}
+
+		// Tempo changes outside the first track can retroactively shift tracks read before them
+		if(options & LOAD_TIMESTAMPS){
+			for(size_t i = 0; i < tracks.size(); i++){
+				if(tempoRevisions[i] != tempoMap.getRevision()){
+					tracks[i].computeTimestamps(tempoMap);
+				}
+			}
 		}
 
 		input.close();
 		return true;
 	}
 
-	// MIDIPlayer
-	MIDIPlayer::MIDIPlayer(const MIDI& midiObject) : midi(midiObject){
-		// TODO: Copy midi object to ensure iterator validness?
-		for(const Track& track : midiObject.getTracks()){
-			nextEvents.push_back(0);
+	// NoteIndex
+	NoteIndex::NoteIndex(const MIDI& midiObject, uint32_t options) : notes(midiObject.getNotes(options)){
+		// Zero length notes never sound
+		std::vector<uint32_t> notesByStart;
+		for(uint32_t i = 0; i < notes.size(); i++){
+			if(notes[i].start < notes[i].end){
+				notesByStart.push_back(i);
+			}
 		}
-		
-		registerEventCallback(SET_TEMPO, [&](Event e){
-			this->setTempo(e.getData().tempo.msPerBeat);
-		});
-	}
 
-	void MIDIPlayer::setTempo(uint32_t msPerBeat){
-		this->msPerBeat = msPerBeat;
+		byStart.reserve(notesByStart.size());
+		byEnd.reserve(notesByStart.size());
+		root = build(notesByStart);
 	}
 
-	void MIDIPlayer::play(){
-		while(!done()){
-			const Event& nextEvent = getNextEvent();
-
-			// Sleep until next event
-			if(nextEvent.getTick() > currentTick){
-				// Calculate time to sleep
-				const auto TpB = midi.getHeader().getTicksPerBeat();
-				const auto UspB = msPerBeat;
-				const auto ticks = nextEvent.getTick() - currentTick;
+	int32_t NoteIndex::build(std::vector<uint32_t>& notesByStart){
+		if(notesByStart.empty()) return -1;
 
-				const auto B = ticks/TpB;
-				const auto Us = UspB * B;
+		// Median start keeps both halves at most half the size, and its own note always overlaps
+		const event_delta_t center = notes[notesByStart[notesByStart.size() / 2]].start;
 
-				std::this_thread::sleep_for(std::chrono::microseconds(Us));
+		std::vector<uint32_t> left, right;
+		const uint32_t first = byStart.size();
 
+		for(uint32_t note : notesByStart){
+			if(notes[note].end <= center){
+				left.push_back(note);
+			}else if(notes[note].start > center){
+				right.push_back(note);
+			}else{
+				byStart.push_back(note);
+				byEnd.push_back(note);
 			}
+		}
 
-			// Call all callbacks for event
-			if(eventCallbacks.find(nextEvent.getType()) != eventCallbacks.end()){
-				for(auto& func : eventCallbacks.at(nextEvent.getType())){
-					func(nextEvent);
-				}
-			}
+		std::sort(byEnd.begin() + first, byEnd.end(), [&](uint32_t a, uint32_t b){
+			return notes[a].end > notes[b].end;
+		});
+
+		const int32_t node = nodes.size();
+		nodes.push_back(Node{center, first, (uint32_t)byStart.size() - first, -1, -1});
+
+		// Children may grow nodes, so don't hold a reference across the calls
+		std::vector<uint32_t>().swap(notesByStart);
+		const int32_t leftNode = build(left);
+		const int32_t rightNode = build(right);
+		nodes[node].left = leftNode;
+		nodes[node].right = rightNode;
+
+		return node;
+	}
 
-			currentTick = nextEvent.getTick();
+	std::vector<const Note*> NoteIndex::notesAt(event_delta_t tick) const{
+		std::vector<const Note*> found;
+		collect(root, tick, tick, found);
+
+		return found;
+	}
+
+	std::vector<const Note*> NoteIndex::notesIn(event_delta_t first, event_delta_t last) const{
+		std::vector<const Note*> found;
+		if(first < last){
+			collect(root, first, last - 1, found);
 		}
+
+		return found;
 	}
 
-	bool MIDIPlayer::done(){
-		for(int i = 0; i < nextEvents.size(); i++){
-			if(!trackIsDone(i)){
-				return false;
+	void NoteIndex::collect(int32_t i, event_delta_t first, event_delta_t last, std::vector<const Note*>& found) const{
+		while(i != -1){
+			const Node& node = nodes[i];
+			const uint32_t* nodeByStart = byStart.data() + node.first;
+			const uint32_t* nodeByEnd = byEnd.data() + node.first;
+
+			if(last < node.center){
+				// Everything here ends after the window starts
+				for(uint32_t j = 0; j < node.count && notes[nodeByStart[j]].start <= last; j++){
+					found.push_back(&notes[nodeByStart[j]]);
+				}
+				i = node.left;
+			}else if(first > node.center){
+				// Everything here starts before the window ends
+				for(uint32_t j = 0; j < node.count && notes[nodeByEnd[j]].end > first; j++){
+					found.push_back(&notes[nodeByEnd[j]]);
+				}
+				i = node.right;
+			}else{
+				// Window contains the center, so every note here overlaps it and both sides may too
+				for(uint32_t j = 0; j < node.count; j++){
+					found.push_back(&notes[nodeByStart[j]]);
+				}
+				collect(node.left, first, last, found);
+				i = node.right;
 			}
 		}
-
-		return true;
 	}
 
-	bool MIDIPlayer::trackIsDone(int trackNum) const{
-		return nextEvents[trackNum] >= midi.getTrack(trackNum).getEvents().size() - 1;
+	const std::vector<Note>& NoteIndex::getNotes() const{
+		return notes;
 	}
 
-	void MIDIPlayer::registerEventCallback(TrackEventType eventType, std::function<void(Event)> func){
-		eventCallbacks[eventType].push_back(func);
+	// ChannelSnapshot
+	ChannelSnapshot::ChannelSnapshot(){
+		for(ChannelState& channel : channels){
+			channel.program = -1;
+			channel.pitchBend = -1;
+			channel.pressure = -1;
+			std::fill(channel.controllers, channel.controllers + 128, -1);
+			channel.nrpnSelected = false;
+		}
 	}
 
-	// TODO: Review readibility
-	// TODO: Fix bug where if track is done the first event is returned
-	const Event& MIDIPlayer::getNextEvent() {
-		size_t* minEventIndex = &nextEvents[0];
-		const Event* minEvent = &getNextEventOfTrack(0);
+	void ChannelSnapshot::apply(const Event& event){
+		ChannelState& channel = channels[event.getChannel() & 0x0F];
+		const auto& data = event.getData();
 
-		for(int i = 0; i < nextEvents.size(); i++){
-			if(trackIsDone(i)) continue;
-			if(getNextEventOfTrack(i).getTick() < minEvent->getTick()){
-				minEventIndex = &nextEvents[i];
-				minEvent = &getNextEventOfTrack(i);
+		switch(event.getType()){
+		case PROGRAM:
+			channel.program = data.program.program & 0x7F;
+			break;
+		case CONTROLLER:{
+			const unsigned char controller = data.controller.function & 0x7F;
+
+			if(controller == 121){
+				// Only the controllers RP-015 lists, volume, pan and bank are kept
+				channel.controllers[1] = 0;
+				channel.controllers[11] = 127;
+				std::fill(channel.controllers + 64, channel.controllers + 68, 0);
+				std::fill(channel.controllers + 98, channel.controllers + 102, 127);
+				channel.pitchBend = 0x2000;
+				channel.pressure = 0;
+			}else if(controller < 120 && controller != 96 && controller != 97){
+				channel.controllers[controller] = data.controller.value & 0x7F;
+
+				if(controller == 98 || controller == 99) channel.nrpnSelected = true;
+				if(controller == 100 || controller == 101) channel.nrpnSelected = false;
 			}
+			break;
+		}
+		case PITCH_BEND_CHANGE:
+			channel.pitchBend = (data.pitchBend.MSB & 0x7F) << 7 | (data.pitchBend.LSB & 0x7F);
+			break;
+		case CHANNEL_PRESSURE:
+			channel.pressure = data.channelPressure.value & 0x7F;
+			break;
+		default:
+			break;
 		}
+	}
+
+	void ChannelSnapshot::getEvents(event_delta_t tick, std::vector<Event>& out) const{
+		for(channel_t i = 0; i < 16; i++){
+			const ChannelState& channel = channels[i];
+
+			// Bank select only takes effect on the next program change
+			for(unsigned char bank : {0, 32}){
+				if(channel.controllers[bank] != -1) out.push_back(Event(CONTROLLER, i, bank, channel.controllers[bank], tick));
+			}
+			if(channel.program != -1) out.push_back(Event(PROGRAM, i, channel.program, 0, tick));
+
+			const auto send = [&](unsigned char controller){
+				if(channel.controllers[controller] != -1) out.push_back(Event(CONTROLLER, i, controller, channel.controllers[controller], tick));
+			};
+
+			for(unsigned char controller = 0; controller < 120; controller++){
+				switch(controller){
+				case 0: case 32: // Bank select
+				case 6: case 38: // Data entry
+				case 98: case 99: case 100: case 101: // Parameter select
+					break;
+				default:
+					send(controller);
+				}
+			}
+
+			// The selected parameter goes last so data entry lands on it
+			static const unsigned char rpnLast[] = {99, 98, 101, 100, 6, 38};
+			static const unsigned char nrpnLast[] = {101, 100, 99, 98, 6, 38};
+			for(unsigned char controller : channel.nrpnSelected ? nrpnLast : rpnLast){
+				send(controller);
+			}
+
+			if(channel.pressure != -1) out.push_back(Event(CHANNEL_PRESSURE, i, channel.pressure, 0, tick));
+			if(channel.pitchBend != -1) out.push_back(Event(PITCH_BEND_CHANGE, i, channel.pitchBend & 0x7F, channel.pitchBend >> 7, tick));
+		}
+	}
+
+	const ChannelState& ChannelSnapshot::getChannel(channel_t channel) const{
+		return channels[channel & 0x0F];
+	}
+
+	// ChannelStateIndex
+	ChannelStateIndex::ChannelStateIndex(const MIDI& midiObject, event_delta_t interval) : interval(std::max<event_delta_t>(interval, 1)){
+		for(const Track& track : midiObject.getTracks()){
+			for(const Event& event : track.getEvents()){
+				switch(event.getType()){
+				case PROGRAM:
+				case CONTROLLER:
+				case PITCH_BEND_CHANGE:
+				case CHANNEL_PRESSURE:
+					stateEvents.push_back(event);
+					break;
+				default:
+					break;
+				}
+			}
+		}
+
+		// Same order as playback, ties between tracks go to the lower track
+		std::stable_sort(stateEvents.begin(), stateEvents.end(), [](const Event& a, const Event& b){
+			return a.getTick() < b.getTick();
+		});
+
+		ChannelSnapshot state;
+		checkpoints.push_back(Checkpoint{0, state});
+
+		// Intervals without events share the checkpoint before them
+		event_delta_t intervalStart = 0;
+		bool changed = false;
+		for(const Event& event : stateEvents){
+			const event_delta_t start = event.getTick() - event.getTick() % this->interval;
+			if(start > intervalStart){
+				if(changed) checkpoints.push_back(Checkpoint{start, state});
+				intervalStart = start;
+				changed = false;
+			}
+
+			state.apply(event);
+			changed = true;
+		}
+	}
+
+	ChannelSnapshot ChannelStateIndex::getStateAt(event_delta_t tick) const{
+		// Last checkpoint at or before tick
+		const auto checkpoint = std::prev(std::upper_bound(checkpoints.begin(), checkpoints.end(), tick, [](event_delta_t t, const Checkpoint& c){
+			return t < c.tick;
+		}));
+
+		const auto byTick = [](const Event& e, event_delta_t t){
+			return e.getTick() < t;
+		};
+		auto first = std::lower_bound(stateEvents.begin(), stateEvents.end(), checkpoint->tick, byTick);
+		auto last = std::lower_bound(first, stateEvents.end(), tick, byTick);
+
+		ChannelSnapshot state = checkpoint->state;
+		for(auto event = first; event != last; event++){
+			state.apply(*event);
+		}
+
+		return state;
+	}
+
+	// LatencyHistogram
+	LatencyHistogram::LatencyHistogram(){
+		reset();
+	}
+
+	void LatencyHistogram::record(uint64_t value){
+		counts[getBucket(value)].fetch_add(1, std::memory_order_relaxed);
+		count.fetch_add(1, std::memory_order_relaxed);
+
+		uint64_t prevMax = max.load(std::memory_order_relaxed);
+		while(value > prevMax && !max.compare_exchange_weak(prevMax, value, std::memory_order_relaxed)){
+		}
+	}
+
+	void LatencyHistogram::reset(){
+		for(std::atomic<uint64_t>& bucket : counts){
+			bucket.store(0, std::memory_order_relaxed);
+		}
+		count.store(0, std::memory_order_relaxed);
+		max.store(0, std::memory_order_relaxed);
+	}
+
+	uint64_t LatencyHistogram::getPercentile(double fraction) const{
+		const uint64_t total = getCount();
+		if(total == 0) return 0;
+
+		const uint64_t target = std::max<uint64_t>(std::ceil(total * fraction), 1);
+
+		uint64_t seen = 0;
+		for(size_t bucket = 0; bucket < BUCKETS; bucket++){
+			seen += counts[bucket].load(std::memory_order_relaxed);
+			if(seen >= target){
+				return std::min(getBucketMax(bucket), getMax());
+			}
+		}
+
+		return getMax();
+	}
+
+	uint64_t LatencyHistogram::getMax() const{
+		return max.load(std::memory_order_relaxed);
+	}
+
+	uint64_t LatencyHistogram::getCount() const{
+		return count.load(std::memory_order_relaxed);
+	}
+
+	size_t LatencyHistogram::getBucket(uint64_t value){
+		if(value < SUB_BUCKETS) return value;
+
+		// Top SUB_BUCKET_BITS + 1 bits of the value select the bucket
+		int msb = 63;
+		while(!(value >> msb)) msb--;
+
+		const int shift = msb - SUB_BUCKET_BITS;
+		return (shift + 1) * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS);
+	}
+
+	uint64_t LatencyHistogram::getBucketMax(size_t bucket){
+		if(bucket < SUB_BUCKETS) return bucket;
+
+		const int shift = bucket / SUB_BUCKETS - 1;
+		const uint64_t subBucket = bucket % SUB_BUCKETS;
+
+		return ((SUB_BUCKETS + subBucket + 1) << shift) - 1;
+	}
+
+	// MIDIPlayer
+	struct MIDIPlayer::SavedThreadState{
+		bool scheduling = false;
+		int policy;
+		sched_param param;
+#ifdef __linux__
+		bool affinity = false;
+		cpu_set_t cpus;
+#endif
+	};
+
+	MIDIPlayer::MIDIPlayer(std::shared_ptr<const MIDI> snapshot) : MIDIPlayer(*checkSnapshot(snapshot)){
+		this->snapshot = std::move(snapshot);
+	}
+
+	MIDIPlayer::MIDIPlayer(const MIDI& midiObject) : midi(&midiObject){
+		trackWords = std::max<size_t>((midiObject.getTracks().size() + 63) / 64, 1);
+		trackMute.assign(trackWords, 0);
+		trackSolo.assign(trackWords, 0);
+		trackMask.reset(new std::atomic<uint64_t>[trackWords]);
+		updateMasks();
+
+		TrackBindings bindings(midiObject);
+		swapBindings(bindings);
+		rebuildHeap();
+	}
+
+	MIDIPlayer::TrackBindings::TrackBindings(const MIDI& midiObject){
+		const std::vector<Track>& tracks = midiObject.getTracks();
+
+		nextEvents.assign(tracks.size(), 0);
+		trackEvents.resize(tracks.size());
+		trackEnds.resize(tracks.size());
+		trackHeap.reserve(tracks.size());
+
+		// A tick's batch can't hold more than every track's longest run of events on one tick
+		size_t maxBatch = 0;
+
+		for(size_t i = 0; i < tracks.size(); i++){
+			const std::vector<Event>& events = tracks[i].getEvents();
+
+			trackEvents[i] = events.data();
+			trackEnds[i] = !events.empty() && events.back().getType() == TRACK_END ? events.size() - 1 : events.size();
+
+			size_t longestRun = 0;
+			for(size_t first = 0, last = 0; first < trackEnds[i]; first = last){
+				while(last < trackEnds[i] && events[last].getTick() == events[first].getTick()) last++;
+				longestRun = std::max(longestRun, last - first);
+			}
+			maxBatch += longestRun;
+		}
+
+		// Playback doesn't allocate once it has started
+		batch.reserve(maxBatch);
+	}
+
+	void MIDIPlayer::swapBindings(TrackBindings& bindings){
+		nextEvents.swap(bindings.nextEvents);
+		trackEvents.swap(bindings.trackEvents);
+		trackEnds.swap(bindings.trackEnds);
+		trackHeap.swap(bindings.trackHeap);
+		batch.swap(bindings.batch);
+	}
+
+	MIDIPlayer::~MIDIPlayer(){
+		join();
+
+		delete swapRequest.load();
+		delete pendingSwap;
+		freeSwaps(retiredSwaps.load());
+	}
+
+	void MIDIPlayer::start(size_t queueCapacity){
+		join();
+
+		outputQueue.reset(new SPSCQueue<TimedEvent>(queueCapacity));
+		running = true;
+
+		timingThread = std::thread([this](){
+			playWith([this](const Event& event){
+				if(!outputQueue->push(TimedEvent{event, eventTime})){
+					droppedEvents.fetch_add(1, std::memory_order_relaxed);
+				}
+			});
+		});
+	}
+
+	void MIDIPlayer::join(){
+		if(timingThread.joinable()){
+			timingThread.join();
+		}
+	}
+
+	bool MIDIPlayer::isRunning() const{
+		return running;
+	}
+
+	bool MIDIPlayer::poll(TimedEvent& event){
+		return outputQueue && outputQueue->pop(event);
+	}
+
+	size_t MIDIPlayer::dispatchQueued(){
+		TimedEvent queued;
+		size_t count = 0;
+
+		while(poll(queued)){
+			for(const Callback& func : eventCallbacks[queued.event.getType()]){
+				func(queued.event, queued.time);
+			}
+			count++;
+		}
+
+		return count;
+	}
+
+	uint64_t MIDIPlayer::getDroppedEvents() const{
+		return droppedEvents.load(std::memory_order_relaxed);
+	}
+
+	void MIDIPlayer::setTempo(uint32_t msPerBeat){
+		this->msPerBeat = msPerBeat;
+	}
+
+	void MIDIPlayer::setSpinThreshold(std::chrono::microseconds threshold){
+		spinThreshold = threshold;
+	}
+
+	void MIDIPlayer::setVirtualClock(bool enabled){
+		virtualClock = enabled;
+	}
+
+	void MIDIPlayer::pause(){
+		paused = true;
+	}
+
+	void MIDIPlayer::resume(){
+		paused = false;
+	}
+
+	bool MIDIPlayer::isPaused() const{
+		return paused;
+	}
+
+	void MIDIPlayer::stop(){
+		stopRequested = true;
+	}
+
+	void MIDIPlayer::seekToTick(event_delta_t tick){
+		seekRequest = tick;
+	}
+
+	void MIDIPlayer::seekToTime(timestamp_t time){
+		// Converted by the playing thread, which owns the current snapshot
+		seekRequest = SEEK_TIME | std::min<timestamp_t>(time, SEEK_TIME - 1);
+	}
+
+	void MIDIPlayer::setLoop(event_delta_t start, event_delta_t end){
+		loopRegion = start < end ? (uint64_t)start << 32 | end : 0;
+	}
+
+	void MIDIPlayer::clearLoop(){
+		loopRegion = 0;
+	}
+
+	void MIDIPlayer::swapAt(std::shared_ptr<const MIDI> snapshot, event_delta_t tick){
+		TrackBindings bindings(*checkSnapshot(snapshot));
+		freeSwaps(retiredSwaps.exchange(nullptr, std::memory_order_acquire));
+
+		// A request the playing thread hasn't taken yet is still ours to free
+		SwapRequest* request = new SwapRequest{std::move(snapshot), tick, nullptr, std::move(bindings)};
+		delete swapRequest.exchange(request, std::memory_order_acq_rel);
+	}
+
+	void MIDIPlayer::takeSwapRequest(){
+		SwapRequest* request = swapRequest.exchange(nullptr, std::memory_order_acq_rel);
+		if(!request) return;
+
+		// The latest swap wins
+		if(pendingSwap) retire(pendingSwap);
+		pendingSwap = request;
+	}
+
+	void MIDIPlayer::applySwap(event_delta_t tick, timestamp_t swapTime){
+		// The old snapshot's part of a tick goes out on its own, its batch is about to be swapped out
+		if(!batch.empty()) flushBatch();
+
+		// The request leaves holding the old snapshot
+		snapshot.swap(pendingSwap->snapshot);
+		swapBindings(pendingSwap->bindings);
+		retire(pendingSwap);
+		pendingSwap = nullptr;
+
+		midi = snapshot.get();
+		channelStateIndex = nullptr;
+
+		moveTo(tick);
+
+		// The new snapshot's timeline may differ, keep the wall clock where it was
+		startTime += swapTime - currentTime;
+	}
+
+	void MIDIPlayer::retire(SwapRequest* request){
+		request->next = retiredSwaps.load(std::memory_order_relaxed);
+		while(!retiredSwaps.compare_exchange_weak(request->next, request, std::memory_order_release, std::memory_order_relaxed)){
+		}
+	}
+
+	void MIDIPlayer::freeSwaps(SwapRequest* list){
+		while(list){
+			SwapRequest* next = list->next;
+			delete list;
+			list = next;
+		}
+	}
+
+	void MIDIPlayer::setRealtime(uint32_t options, int priority, int cpu){
+		realtimeOptions = options;
+		realtimePriority = priority;
+		realtimeCPU = cpu;
+	}
+
+	uint32_t MIDIPlayer::getRealtimeApplied() const{
+		return realtimeApplied;
+	}
+
+	void MIDIPlayer::applyRealtime(){
+		uint32_t applied = REALTIME_NONE;
+
+		if(!savedThreadState) savedThreadState.reset(new SavedThreadState());
+		SavedThreadState& saved = *savedThreadState;
+		saved = SavedThreadState();
+
+		if(realtimeOptions & REALTIME_LOCK_MEMORY){
+			if(mlockall(MCL_CURRENT | MCL_FUTURE) == 0) applied |= REALTIME_LOCK_MEMORY;
+		}
+
+		if(realtimeOptions & REALTIME_PRIORITY){
+			sched_param param{};
+			param.sched_priority = std::min(std::max(realtimePriority, sched_get_priority_min(SCHED_FIFO)), sched_get_priority_max(SCHED_FIFO));
+			saved.scheduling = pthread_getschedparam(pthread_self(), &saved.policy, &saved.param) == 0;
+			if(saved.scheduling && pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0) applied |= REALTIME_PRIORITY;
+		}
+
+#ifdef __linux__
+		// CPU_SET doesn't check its index
+		if((realtimeOptions & REALTIME_AFFINITY) && realtimeCPU >= 0 && realtimeCPU < CPU_SETSIZE){
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(realtimeCPU, &cpus);
+			saved.affinity = pthread_getaffinity_np(pthread_self(), sizeof(saved.cpus), &saved.cpus) == 0;
+			if(saved.affinity && pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0) applied |= REALTIME_AFFINITY;
+		}
+#endif
+
+		if(realtimeOptions & REALTIME_PREFAULT){
+			// One read per page brings the events in, and keeps them in when memory is locked
+			const size_t page = 4096;
+			volatile unsigned char sink = 0;
+			for(const Track& track : midi->getTracks()){
+				const std::vector<Event>& events = track.getEvents();
+				const unsigned char* bytes = (const unsigned char*)events.data();
+				for(size_t i = 0; i < events.size() * sizeof(Event); i += page){
+					sink += bytes[i];
+				}
+
+				const std::vector<timestamp_t>& timestamps = track.getTimestamps();
+				bytes = (const unsigned char*)timestamps.data();
+				for(size_t i = 0; i < timestamps.size() * sizeof(timestamp_t); i += page){
+					sink += bytes[i];
+				}
+			}
+
+			// Stack the callbacks are likely to grow into
+			volatile unsigned char stack[64 * 1024];
+			for(size_t i = 0; i < sizeof(stack); i += page){
+				stack[i] = 0;
+			}
+
+			applied |= REALTIME_PREFAULT;
+		}
+
+		realtimeApplied = applied;
+	}
+
+	void MIDIPlayer::restoreRealtime(){
+		const uint32_t applied = realtimeApplied;
+
+		if(applied & REALTIME_PRIORITY){
+			pthread_setschedparam(pthread_self(), savedThreadState->policy, &savedThreadState->param);
+		}
+
+#ifdef __linux__
+		if(applied & REALTIME_AFFINITY){
+			pthread_setaffinity_np(pthread_self(), sizeof(savedThreadState->cpus), &savedThreadState->cpus);
+		}
+#endif
+	}
+
+	void MIDIPlayer::enableInjection(size_t capacity){
+		injectQueue.reset(new MPSCQueue<TimedEvent>(capacity));
+		injectedWaiting = 0;
+		injected.clear();
+		injected.reserve(injectQueue->getCapacity());
+	}
+
+	bool MIDIPlayer::inject(const Event& event, timestamp_t time){
+		if(!injectQueue) return false;
+
+		// Claim a place first, the queue alone can't bound what's already been drained
+		const size_t waiting = injectedWaiting.fetch_add(1, std::memory_order_relaxed);
+		if(waiting >= injectQueue->getCapacity() || !injectQueue->push(TimedEvent{event, time})){
+			injectedWaiting.fetch_sub(1, std::memory_order_relaxed);
+			return false;
+		}
+		return true;
+	}
+
+	void MIDIPlayer::drainInjected(){
+		if(!injectQueue) return;
+
+		TimedEvent event;
+		while(injectQueue->pop(event)){
+			injected.push_back(event);
+			std::push_heap(injected.begin(), injected.end(), injectedIsLater);
+		}
+	}
+
+	void MIDIPlayer::setChannelMute(uint16_t mask){
+		std::lock_guard<std::mutex> lock(maskMutex);
+		channelMute = mask;
+		updateMasks();
+	}
+
+	void MIDIPlayer::setChannelSolo(uint16_t mask){
+		std::lock_guard<std::mutex> lock(maskMutex);
+		channelSolo = mask;
+		updateMasks();
+	}
+
+	void MIDIPlayer::setTrackMute(uint64_t mask){
+		std::lock_guard<std::mutex> lock(maskMutex);
+		trackMute[0] = mask;
+		updateMasks();
+	}
+
+	void MIDIPlayer::setTrackSolo(uint64_t mask){
+		std::lock_guard<std::mutex> lock(maskMutex);
+		trackSolo[0] = mask;
+		updateMasks();
+	}
+
+	void MIDIPlayer::setTrackMuted(uint32_t track, bool muted){
+		std::lock_guard<std::mutex> lock(maskMutex);
+		if(track / 64 >= trackWords) return;
+
+		const uint64_t bit = uint64_t(1) << (track & 63);
+		trackMute[track / 64] = muted ? trackMute[track / 64] | bit : trackMute[track / 64] & ~bit;
+		updateMasks();
+	}
+
+	void MIDIPlayer::setTrackSoloed(uint32_t track, bool soloed){
+		std::lock_guard<std::mutex> lock(maskMutex);
+		if(track / 64 >= trackWords) return;
+
+		const uint64_t bit = uint64_t(1) << (track & 63);
+		trackSolo[track / 64] = soloed ? trackSolo[track / 64] | bit : trackSolo[track / 64] & ~bit;
+		updateMasks();
+	}
+
+	void MIDIPlayer::updateMasks(){
+		channelMask = (channelSolo ? channelSolo : 0xFFFF) & ~channelMute;
+
+		const bool soloActive = std::any_of(trackSolo.begin(), trackSolo.end(), [](uint64_t word){ return word != 0; });
+		for(size_t i = 0; i < trackWords; i++){
+			trackMask[i] = (soloActive ? trackSolo[i] : ~uint64_t(0)) & ~trackMute[i];
+		}
+		trackSoloActive = soloActive;
+	}
+
+	void MIDIPlayer::setChannelStateIndex(const ChannelStateIndex* index){
+		channelStateIndex = index;
+
+		// Room for every channel's full state, so chasing doesn't allocate
+		chaseEvents.reserve(16 * (128 + 3));
+	}
+
+	timestamp_t MIDIPlayer::getTime() const{
+		return currentTime;
+	}
+
+	void MIDIPlayer::setInstrumentation(bool enabled){
+		if(!enabled){
+			instrumentation.reset();
+		}else if(!instrumentation){
+			instrumentation.reset(new Instrumentation());
+		}
+	}
+
+	PlaybackStats MIDIPlayer::getStats() const{
+		PlaybackStats stats = {};
+		if(!instrumentation) return stats;
+
+		const LatencyHistogram& lateness = instrumentation->lateness;
+		const LatencyHistogram& callback = instrumentation->callback;
+
+		stats.events = lateness.getCount();
+		stats.latenessP50 = lateness.getPercentile(0.5);
+		stats.latenessP99 = lateness.getPercentile(0.99);
+		stats.latenessMax = lateness.getMax();
+		stats.callbackP50 = callback.getPercentile(0.5);
+		stats.callbackP99 = callback.getPercentile(0.99);
+		stats.callbackMax = callback.getMax();
+
+		return stats;
+	}
+
+	void MIDIPlayer::recordDispatch(std::chrono::steady_clock::time_point dispatched){
+		const auto done = std::chrono::steady_clock::now();
+
+		// Stepped players are dispatched at the step's time rather than the steady clock's
+		const int64_t deadline = startTime + eventTime;
+		const int64_t lateness = stepping
+			? (stepTime - deadline) * 1000
+			: std::chrono::duration_cast<std::chrono::nanoseconds>(dispatched.time_since_epoch()).count() - deadline * 1000;
+		const auto callback = std::chrono::duration_cast<std::chrono::nanoseconds>(done - dispatched).count();
+
+		instrumentation->lateness.record(lateness > 0 ? lateness : 0);
+		instrumentation->callback.record(callback);
+	}
+
+	bool MIDIPlayer::prepareNextEvent(){
+		nextDeadline = NO_DEADLINE;
+
+		while(!stopRequested){
+			const int64_t seek = seekRequest.exchange(NO_SEEK);
+			if(seek != NO_SEEK){
+				moveTo(seek & SEEK_TIME ? midi->getTempoMap().microsToTick(seek & ~SEEK_TIME) : seek);
+				startTime = now() - currentTime;
+				pausePosition = currentTime;
+			}
+
+			if(paused){
+				if(!pauseApplied){
+					pausePosition = std::min<timestamp_t>(std::max<int64_t>(now() - startTime, 0), currentTime);
+					pauseApplied = true;
+				}
+
+				if(stepping){
+					nextDeadline = now() + transportPollInterval.count();
+					return false;
+				}
+
+				std::this_thread::sleep_for(transportPollInterval);
+				continue;
+			}
+
+			if(pauseApplied){
+				startTime = now() - pausePosition;
+				pauseApplied = false;
+			}
+
+			// Chased state is due as soon as the seek is
+			if(chasePosition < chaseEvents.size()) return true;
+
+			drainInjected();
+			if(!injected.empty()){
+				const timestamp_t injectedTime = injected.front().time;
+
+				if(done() || injectedTime < getTimeOfTick(peekNextEvent().getTick())){
+					if(reached(startTime + injectedTime)){
+						injectedDue = true;
+						return true;
+					}
+					if(stepping) return false;
+					continue;
+				}
+			}
+
+			if(swapRequest.load(std::memory_order_relaxed)) takeSwapRequest();
+			if(pendingSwap && (done() || peekNextEvent().getTick() >= pendingSwap->tick)){
+				const event_delta_t tick = std::max(pendingSwap->tick, currentTick);
+				const timestamp_t swapTime = getTimeOfTick(tick);
+
+				if(reached(startTime + swapTime)){
+					applySwap(tick, swapTime);
+				}else if(stepping){
+					return false;
+				}
+				continue;
+			}
+
+			const uint64_t loop = loopRegion;
+			const event_delta_t loopStart = loop >> 32;
+			const event_delta_t loopEnd = loop & 0xFFFFFFFF;
+
+			if(loop && currentTick < loopEnd && (done() || peekNextEvent().getTick() >= loopEnd)){
+				// Wait out the rest of the loop, then carry on from its start as if no time had passed
+				const timestamp_t loopEndTime = getTimeOfTick(loopEnd);
+				if(reached(startTime + loopEndTime)){
+					moveTo(loopStart);
+					startTime += loopEndTime - currentTime;
+				}else if(stepping){
+					return false;
+				}
+				continue;
+			}
+
+			if(done()) return false;
+
+			advanceTimeline(peekNextEvent().getTick());
+			if(reached(startTime + currentTime)) return true;
+			if(stepping) return false;
+		}
+
+		return false;
+	}
+
+	bool MIDIPlayer::reached(int64_t deadline){
+		if(stepping){
+			if(deadline <= stepTime) return true;
+
+			nextDeadline = deadline;
+			return false;
+		}
+
+		return virtualClock || waitUntil(deadline);
+	}
+
+	bool MIDIPlayer::waitUntil(int64_t deadline) const{
+		const std::chrono::steady_clock::time_point deadlineTime{std::chrono::microseconds(deadline)};
+
+		// Sleep in short slices so transport requests are noticed
+		const auto sleepDeadline = deadlineTime - spinThreshold;
+		for(auto now = std::chrono::steady_clock::now(); now < sleepDeadline; now = std::chrono::steady_clock::now()){
+			if(transportPending()) return false;
+			std::this_thread::sleep_until(std::min(sleepDeadline, now + transportPollInterval));
+		}
+
+		while(std::chrono::steady_clock::now() < deadlineTime){
+		}
+
+		return !transportPending();
+	}
+
+	int64_t MIDIPlayer::now() const{
+		if(stepping) return stepTime;
+
+		return steadyMicros();
+	}
+
+	int64_t MIDIPlayer::advanceTo(int64_t now){
+		return stepWith(now, [this](const Event& nextEvent){
+			callCallbacks(nextEvent);
+		});
+	}
+
+	int64_t MIDIPlayer::advanceBatchesTo(int64_t now){
+		return stepWith(now, [this](const Event& nextEvent){
+			callBatchCallbacks(nextEvent);
+		});
+	}
+
+	size_t MIDIPlayer::render(uint32_t frames, uint32_t sampleRate, BlockEvent* out, size_t capacity){
+		// Keep the position when the rate changes
+		if(renderSampleRate && sampleRate != renderSampleRate){
+			renderedFrames = renderedFrames * sampleRate / renderSampleRate;
+		}
+		renderSampleRate = sampleRate;
+
+		// The render clock is in microseconds, an event on microsecond t falls on sample floor(t * rate / 1e6)
+		const auto frameToMicros = [sampleRate](uint64_t frame){
+			return int64_t((frame * 1000000 + sampleRate - 1) / sampleRate);
+		};
+
+		const uint64_t firstFrame = renderedFrames;
+		renderedFrames += frames;
+
+		size_t count = 0;
+		const auto collect = [&](const Event& event){
+			if(count == capacity){
+				droppedEvents.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+
+			const uint64_t frame = uint64_t(startTime + eventTime) * sampleRate / 1000000;
+
+			// Late events, after a seek or resume, go at the start of the block
+			out[count++] = BlockEvent{event, uint32_t(frame > firstFrame ? std::min<uint64_t>(frame - firstFrame, frames - 1) : 0)};
+		};
+
+		if(frames == 0) return 0;
+
+		// Starts the timeline, and applies seeks and resumes, at the start of the block
+		stepWith(frameToMicros(firstFrame), collect);
+
+		stepWith(frameToMicros(renderedFrames) - 1, collect);
+
+		return count;
+	}
+
+	int64_t MIDIPlayer::getNextDeadline() const{
+		return nextDeadline;
+	}
+
+	bool MIDIPlayer::transportPending() const{
+		const bool injectionPending = injectQueue && !injectQueue->empty();
+
+		return paused || stopRequested || seekRequest != NO_SEEK || swapRequest.load(std::memory_order_relaxed) || injectionPending;
+	}
+
+	timestamp_t MIDIPlayer::getTimeOfTick(event_delta_t tick) const{
+		const uint64_t TpB = midi->getHeader().getTicksPerBeat();
+		const uint64_t UspB = msPerBeat;
+		const uint64_t ticks = tick - currentTick;
+
+		return currentTime + (ticks * UspB + timeRemainder) / TpB;
+	}
+
+	void MIDIPlayer::advanceTimeline(event_delta_t tick){
+		if(tick <= currentTick) return;
+
+		const uint64_t TpB = midi->getHeader().getTicksPerBeat();
+		const uint64_t UspB = msPerBeat;
+		const uint64_t ticks = tick - currentTick;
+
+		const uint64_t Us = ticks * UspB + timeRemainder;
+		currentTime += Us / TpB;
+		timeRemainder = Us % TpB;
+		currentTick = tick;
+	}
+
+	void MIDIPlayer::moveTo(event_delta_t tick){
+		for(size_t i = 0; i < nextEvents.size(); i++){
+			nextEvents[i] = midi->getTrack(i).getEventIndexAt(tick);
+		}
+		rebuildHeap();
+
+		const TempoMap& tempoMap = midi->getTempoMap();
+		currentTick = tick;
+		currentTime = tempoMap.tickToMicros(tick);
+		timeRemainder = 0;
+		msPerBeat = tempoMap.getTempoAt(tick);
+
+		chaseEvents.clear();
+		chasePosition = 0;
+		if(channelStateIndex){
+			channelStateIndex->getStateAt(tick).getEvents(tick, chaseEvents);
+		}
+	}
+
+	void MIDIPlayer::rebuildHeap(){
+		trackHeap.clear();
+		for(uint32_t i = 0; i < nextEvents.size(); i++){
+			if(!trackIsDone(i)){
+				trackHeap.push_back(i);
+			}
+		}
+
+		std::make_heap(trackHeap.begin(), trackHeap.end(), [this](uint32_t a, uint32_t b){
+			return trackIsLater(a, b);
+		});
+	}
+
+	void MIDIPlayer::play(){
+		playWith([this](const Event& nextEvent){
+			callCallbacks(nextEvent);
+		});
+	}
+
+	void MIDIPlayer::playBatches(){
+		playWith([this](const Event& nextEvent){
+			callBatchCallbacks(nextEvent);
+		});
+	}
+
+	void MIDIPlayer::callCallbacks(const Event& event){
+		for(const Callback& func : eventCallbacks[event.getType()]){
+			func(event, eventTime);
+		}
+
+		if(batchCallbacks.empty() || eventInjected) return;
+
+		addToBatch(event);
+	}
+
+	void MIDIPlayer::callBatchCallbacks(const Event& event){
+		if(!eventInjected){
+			addToBatch(event);
+			return;
+		}
+
+		const EventRange range(&event, &event + 1);
+		for(const BatchCallback& func : batchCallbacks){
+			func(range, eventTime);
+		}
+	}
+
+	void MIDIPlayer::addToBatch(const Event& event){
+		batch.push_back(event);
+		if(!nextIsSameTick()) flushBatch();
+	}
+
+	void MIDIPlayer::flushBatch(){
+		const EventRange range(batch.data(), batch.data() + batch.size());
+		for(const BatchCallback& func : batchCallbacks){
+			func(range, currentTime);
+		}
+		batch.clear();
+	}
+
+	bool MIDIPlayer::isAudible(const Event& event) const{
+		const TrackEventType type = event.getType();
+
+		if(eventTrack != NO_TRACK){
+			// Tracks a swap added past the masks can't be soloed
+			const size_t word = eventTrack / 64;
+			const bool audible = word < trackWords
+				? trackMask[word].load(std::memory_order_relaxed) >> (eventTrack & 63) & 1
+				: !trackSoloActive.load(std::memory_order_relaxed);
+			if(!audible) return false;
+		}
+
+		// Only channel events carry a channel
+		return type < NOTE_OFF || type >= SYS_EX || (channelMask.load(std::memory_order_relaxed) >> (event.getChannel() & 0x0F) & 1);
+	}
+
+	bool MIDIPlayer::nextIsSameTick(){
+		if(chasePosition < chaseEvents.size()) return true;
+
+		return !done() && peekNextEvent().getTick() == currentTick;
+	}
+
+	bool MIDIPlayer::done(){
+		return trackHeap.empty();
+	}
+
+	PlayerScheduler::PlayerScheduler(size_t threads, std::chrono::microseconds resolution) : resolution(std::max<int64_t>(resolution.count(), 1)){
+		for(size_t i = 0; i < std::max<size_t>(threads, 1); i++){
+			shards.emplace_back(new Shard());
+		}
+
+		for(const std::unique_ptr<Shard>& shard : shards){
+			Shard* s = shard.get();
+			s->thread = std::thread([this, s]{ run(*s); });
+		}
+	}
+
+	PlayerScheduler::~PlayerScheduler(){
+		stopping = true;
+		for(const std::unique_ptr<Shard>& shard : shards){
+			std::lock_guard<std::mutex> lock(shard->mutex);
+			shard->wake.notify_one();
+		}
+
+		for(const std::unique_ptr<Shard>& shard : shards){
+			shard->thread.join();
+		}
+	}
+
+	void PlayerScheduler::add(MIDIPlayer& player){
+		Shard* target = shards[0].get();
+		for(const std::unique_ptr<Shard>& shard : shards){
+			if(shard->players < target->players) target = shard.get();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(idleMutex);
+			activePlayers++;
+		}
+
+		target->players++;
+
+		std::lock_guard<std::mutex> lock(target->mutex);
+		target->pending.push_back(&player);
+		target->wake.notify_one();
+	}
+
+	void PlayerScheduler::wait(){
+		std::unique_lock<std::mutex> lock(idleMutex);
+		idle.wait(lock, [this]{ return activePlayers == 0; });
+	}
+
+	size_t PlayerScheduler::getActivePlayers() const{
+		std::lock_guard<std::mutex> lock(idleMutex);
+		return activePlayers;
+	}
+
+	void PlayerScheduler::run(Shard& shard){
+		std::vector<MIDIPlayer*> added;
+		std::vector<MIDIPlayer*> due;
+
+		while(true){
+			{
+				std::unique_lock<std::mutex> lock(shard.mutex);
+
+				const auto ready = [&]{ return stopping || !shard.pending.empty(); };
+				if(shard.scheduled){
+					// Sleep to the next wheel tick
+					const std::chrono::steady_clock::time_point nextTick{std::chrono::microseconds((shard.currentTick + 1) * resolution)};
+					shard.wake.wait_until(lock, nextTick, ready);
+				}else{
+					shard.wake.wait(lock, ready);
+				}
+
+				if(stopping) return;
+				added.swap(shard.pending);
+			}
+
+			const int64_t now = steadyMicros();
+			const uint64_t nowTick = now / resolution;
+
+			// An empty wheel has nothing to catch up on
+			if(!shard.scheduled) shard.currentTick = nowTick;
+
+			advance(shard, nowTick, due);
+			for(MIDIPlayer* player : due){
+				step(shard, player, now);
+			}
+			due.clear();
+
+			for(MIDIPlayer* player : added){
+				step(shard, player, now);
+			}
+			added.clear();
+		}
+	}
+
+	void PlayerScheduler::step(Shard& shard, MIDIPlayer* player, int64_t now){
+		const int64_t deadline = player->advanceTo(now);
+
+		if(deadline == NO_DEADLINE){
+			shard.players--;
+
+			std::lock_guard<std::mutex> lock(idleMutex);
+			if(--activePlayers == 0) idle.notify_all();
+			return;
+		}
+
+		// Rounded up so a player is never woken before its deadline
+		const uint64_t due = (deadline + resolution - 1) / resolution;
+		schedule(shard, Entry{player, std::max(due, shard.currentTick + 1)});
+		shard.scheduled++;
+	}
+
+	void PlayerScheduler::schedule(Shard& shard, const Entry& entry){
+		const uint64_t delta = entry.due > shard.currentTick ? entry.due - shard.currentTick : 0;
+
+		// The lowest level whose span covers the delta, anything further waits in the top level and is cascaded again
+		uint32_t level = 0;
+		while(level < wheelLevels - 1 && delta >= (uint64_t(1) << (wheelBits * (level + 1)))){
+			level++;
+		}
+
+		const uint64_t slotTick = std::min(entry.due, shard.currentTick + (uint64_t(wheelSlots - 1) << (wheelBits * level)));
+		shard.wheel[level][(slotTick >> (wheelBits * level)) & (wheelSlots - 1)].push_back(entry);
+	}
+
+	void PlayerScheduler::advance(Shard& shard, uint64_t tick, std::vector<MIDIPlayer*>& due){
+		while(shard.currentTick < tick && shard.scheduled){
+			shard.currentTick++;
+
+			// Higher levels first so their entries can fall through to the slot expiring now
+			for(uint32_t level = wheelLevels - 1; level > 0; level--){
+				if(shard.currentTick & ((uint64_t(1) << (wheelBits * level)) - 1)) continue;
+
+				std::vector<Entry>& slot = shard.wheel[level][(shard.currentTick >> (wheelBits * level)) & (wheelSlots - 1)];
+				std::vector<Entry> cascading;
+				cascading.swap(slot);
+				for(const Entry& entry : cascading){
+					schedule(shard, entry);
+				}
+			}
+
+			std::vector<Entry>& slot = shard.wheel[0][shard.currentTick & (wheelSlots - 1)];
+			for(const Entry& entry : slot){
+				due.push_back(entry.player);
+			}
+			shard.scheduled -= slot.size();
+			slot.clear();
+		}
+
+		shard.currentTick = std::max(shard.currentTick, tick);
+	}
+
+	bool MIDIPlayer::trackIsDone(int trackNum) const{
+		return nextEvents[trackNum] >= trackEnds[trackNum];
+	}
+
+	void MIDIPlayer::registerEventCallback(TrackEventType eventType, EventCallback func){
+		eventCallbacks[eventType].push_back(Callback{std::move(func), nullptr});
+	}
+
+	void MIDIPlayer::registerEventCallback(TrackEventType eventType, TimedEventCallback func){
+		eventCallbacks[eventType].push_back(Callback{nullptr, std::move(func)});
+	}
+
+	void MIDIPlayer::registerBatchCallback(BatchCallback func){
+		batchCallbacks.push_back(func);
+	}
+
+	const Event& MIDIPlayer::takeNextEvent(){
+		if(injectedDue){
+			injectedDue = false;
+
+			std::pop_heap(injected.begin(), injected.end(), injectedIsLater);
+			injectedEvent = injected.back();
+			injected.pop_back();
+			injectedWaiting.fetch_sub(1, std::memory_order_relaxed);
+
+			eventTrack = NO_TRACK;
+			eventTime = injectedEvent.time;
+			eventInjected = true;
+			return injectedEvent.event;
+		}
+
+		eventTime = currentTime;
+		eventInjected = false;
+
+		if(chasePosition < chaseEvents.size()){
+			eventTrack = NO_TRACK;
+			return chaseEvents[chasePosition++];
+		}
+
+		return getNextEvent();
+	}
+
+	// O(log tracks), only call when not done()
+	const Event& MIDIPlayer::getNextEvent() {
+		const auto later = [this](uint32_t a, uint32_t b){
+			return trackIsLater(a, b);
+		};
+
+		// Move the earliest track to the back, advance it, then sift it back in if it has more events
+		std::pop_heap(trackHeap.begin(), trackHeap.end(), later);
+		const uint32_t track = trackHeap.back();
+		eventTrack = track;
+
+		const Event& event = getNextEventOfTrack(track);
+		nextEvents[track]++;
+
+		if(trackIsDone(track)){
+			trackHeap.pop_back();
+		}else{
+			std::push_heap(trackHeap.begin(), trackHeap.end(), later);
+		}
+
+		return event;
+	}
+
+	const Event& MIDIPlayer::peekNextEvent() const{
+		return getNextEventOfTrack(trackHeap.front());
+	}
 
-		(*minEventIndex)++;
+	bool MIDIPlayer::trackIsLater(uint32_t a, uint32_t b) const{
+		const event_delta_t tickA = getNextEventOfTrack(a).getTick();
+		const event_delta_t tickB = getNextEventOfTrack(b).getTick();
 
-		return *minEvent;
+		return tickA > tickB || (tickA == tickB && a > b);
 	}
 
 	
 	const Event& MIDIPlayer::getNextEventOfTrack(int trackNum) const {
-		return midi.getEvent(trackNum, nextEvents[trackNum]);
+		return trackEvents[trackNum][nextEvents[trackNum]];
 	}
 
 }
@@ -0,0 +1,112 @@
+#define CPP_MIDI_H_IMPL
+
+#include "../cppmidi.h"
+#include <cstdio>
+#include <unordered_map>
+
+// Dispatch benchmarks, run with `make bench`
+//	Every event sits on tick 0 so the player never sleeps and only dispatch is measured
+
+namespace{
+	const char* benchFile = "bench.mid";
+	const uint32_t benchEvents = 1000000;
+
+	void writeBenchFile(){
+		std::ofstream out(benchFile, std::ios::binary);
+
+		const unsigned char header[] = {'M','T','h','d', 0,0,0,6, 0,0, 0,1, 0,96};
+		out.write((const char*)header, sizeof(header));
+
+		// Delta 0, note on/off alternating, then end of track
+		const uint32_t len = benchEvents * 4 + 4;
+		const unsigned char track[] = {'M','T','r','k', (unsigned char)(len >> 24), (unsigned char)(len >> 16), (unsigned char)(len >> 8), (unsigned char)len};
+		out.write((const char*)track, sizeof(track));
+
+		for(uint32_t i = 0; i < benchEvents; i++){
+			const unsigned char event[] = {0, (unsigned char)(i % 2 ? 0x80 : 0x90), 60, 100};
+			out.write((const char*)event, sizeof(event));
+		}
+
+		const unsigned char end[] = {0, 0xFF, 0x2F, 0};
+		out.write((const char*)end, sizeof(end));
+	}
+
+	template<typename F>
+	double nsPerEvent(F f){
+		const auto start = std::chrono::steady_clock::now();
+		f();
+		const auto end = std::chrono::steady_clock::now();
+
+		return std::chrono::duration<double, std::nano>(end - start).count() / benchEvents;
+	}
+}
+
+int main(){
+	writeBenchFile();
+
+	midi::MIDI m;
+	if(!m.loadFile(benchFile)) return 1;
+
+	volatile uint32_t sink = 0;
+
+	for(int callbacks : {0, 1, 4}){
+		midi::MIDIPlayer player(m);
+		for(int i = 0; i < callbacks; i++){
+			player.registerEventCallback(midi::NOTE_ON, [&](const midi::Event& e){ sink += e.getData().note.note; });
+			player.registerEventCallback(midi::NOTE_OFF, [&](const midi::Event& e){ sink += e.getData().note.note; });
+		}
+
+		std::printf("MIDIPlayer::play, %d callback(s) per event: %.1f ns/event\n", callbacks, nsPerEvent([&]{ player.play(); }));
+	}
+
+	{
+		midi::MIDIPlayer player(m);
+		player.registerEventCallback(midi::NOTE_ON, [&](const midi::Event& e, midi::timestamp_t){ sink += e.getData().note.note; });
+		player.registerEventCallback(midi::NOTE_OFF, [&](const midi::Event& e, midi::timestamp_t){ sink += e.getData().note.note; });
+
+		std::printf("MIDIPlayer::play, 1 timed callback per event: %.1f ns/event\n", nsPerEvent([&]{ player.play(); }));
+	}
+
+	{
+		midi::MIDIPlayer player(m);
+		player.registerBatchCallback([&](const midi::EventRange& range, midi::timestamp_t){
+			for(const midi::Event& e : range) sink += e.getData().note.note;
+		});
+
+		// With every event on one tick the batch holds the whole file, a first run pages it in
+		player.playBatches();
+		player.seekToTick(0);
+
+		std::printf("MIDIPlayer::playBatches, 1 batch callback per tick: %.1f ns/event\n", nsPerEvent([&]{ player.playBatches(); }));
+	}
+
+	{
+		struct NoteHandler{
+			volatile uint32_t& sink;
+
+			void operator()(midi::EventTag<midi::NOTE_ON>, const midi::Event& e){ sink += e.getData().note.note; }
+			void operator()(midi::EventTag<midi::NOTE_OFF>, const midi::Event& e){ sink += e.getData().note.note; }
+		};
+
+		midi::StaticMIDIPlayer<NoteHandler> player(m, NoteHandler{sink});
+		std::printf("StaticMIDIPlayer::play, 1 handler per event: %.1f ns/event\n", nsPerEvent([&]{ player.play(); }));
+	}
+
+	// The original dispatch, a map lookup and a by value std::function call per event, to compare with the player above
+	std::unordered_map<midi::TrackEventType, std::vector<std::function<void(midi::Event)>>> mapCallbacks;
+	mapCallbacks[midi::NOTE_ON].push_back([&](midi::Event e){ sink += e.getData().note.note; });
+	mapCallbacks[midi::NOTE_OFF].push_back([&](midi::Event e){ sink += e.getData().note.note; });
+
+	std::printf("unordered_map dispatch only, 1 callback per event: %.1f ns/event\n", nsPerEvent([&]{
+		for(const midi::Event& event : m.getTrack(0).getEvents()){
+			if(mapCallbacks.find(event.getType()) != mapCallbacks.end()){
+				for(auto& func : mapCallbacks.at(event.getType())){
+					func(event);
+				}
+			}
+		}
+	}));
+
+	std::remove(benchFile);
+	return 0;
+}
@@ -4,12 +4,68 @@
 #include "catch.hpp" 
 #include "../cppmidi.h"
 #include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <numeric>
+
+namespace{
+	// Counts heap allocations while enabled, for checking playback doesn't allocate
+	//	cppmidi.h never calls malloc itself, and the standard containers and std::function
+	//	all allocate through operator new, so counting it covers the library's allocations
+	std::atomic<bool> countAllocations{false};
+	std::atomic<size_t> allocations{0};
+}
+
+void* operator new(size_t size){
+	if(countAllocations) allocations++;
+
+	void* memory = std::malloc(size ? size : 1);
+	if(!memory) throw std::bad_alloc();
+	return memory;
+}
+
+void* operator new[](size_t size){
+	return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept{
+	if(countAllocations) allocations++;
+
+	return std::malloc(size ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept{
+	return operator new(size, tag);
+}
+
+void operator delete(void* memory) noexcept{
+	std::free(memory);
+}
+
+void operator delete[](void* memory) noexcept{
+	std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept{
+	std::free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept{
+	std::free(memory);
+}
+
+void operator delete(void* memory, const std::nothrow_t&) noexcept{
+	std::free(memory);
+}
+
+void operator delete[](void* memory, const std::nothrow_t&) noexcept{
+	std::free(memory);
+}
 
 
 TEST_CASE("Header struct makes sense", "[header]"){
-	CHECK(offsetof(midi::Header, type)==0);
-	CHECK(offsetof(midi::Header, numTracks)==2);
-	CHECK(offsetof(midi::Header, ticksPerQuater)==4);
+	// Header is read straight from the file, so it must match the on-disk layout
+	CHECK(sizeof(midi::Header)==6);
 }
 
 TEST_CASE("Bad magic fails to load", "[header][loading]"){
@@ -23,6 +79,12 @@ TEST_CASE("Non existent file fails to load", "[loading]"){
 	REQUIRE_FALSE(m.loadFile("TTTTTTTTTTTTTT"));
 }
 
+TEST_CASE("Zero division fails to load", "[header][loading]"){
+	// Tempo changes would divide by the division
+	midi::MIDI m;
+	REQUIRE_FALSE(m.loadFile("c.0.1.0"));
+}
+
 TEST_CASE("Correct header loads", "[header][loading]"){
 	midi::MIDI m;
 	REQUIRE(m.loadFile("c.1.1.1284"));
@@ -33,24 +95,1519 @@ TEST_CASE("Correct header loads", "[header][loading]"){
 TEST_CASE("Type loads", "[header][loading]"){
 	midi::MIDI m;
 	m.loadFile("c.1.1.1284");
-	REQUIRE(m.getHeader().type == 1);
+	REQUIRE(m.getHeader().getType() == 1);
 	m.loadFile("c.0.1.9");
-	REQUIRE(m.getHeader().type == 0);
+	REQUIRE(m.getHeader().getType() == 0);
 }
 
 TEST_CASE("Num Tracks Load", "[header][loading]"){
 	midi::MIDI m;
 	m.loadFile("c.1.1.1284");
-	REQUIRE(m.getHeader().numTracks == 1);
+	REQUIRE(m.getHeader().getNumTracks() == 1);
 
 	m.loadFile("c.1.4.1284");
-	REQUIRE(m.getHeader().numTracks == 4);
+	REQUIRE(m.getHeader().getNumTracks() == 4);
 }
 
 TEST_CASE("Num Ticks Load", "[header][loading]"){
 	midi::MIDI m;
 	m.loadFile("c.1.1.1284");
-	REQUIRE(m.getHeader().ticksPerQuater == 257);
+	REQUIRE(m.getHeader().getTicksPerBeat() == 257);
 	m.loadFile("c.0.1.9");
-	REQUIRE(m.getHeader().ticksPerQuater == 9);
+	REQUIRE(m.getHeader().getTicksPerBeat() == 9);
+}
+
+// c.1.3.96: conductor track with tempo/time signature changes, a piano track on channel 0
+// and a drum/controller track on channels 3 and 9
+
+TEST_CASE("Tempo map loads", "[loading][timing]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+
+	const auto& changes = m.getTempoMap().getChanges();
+	REQUIRE(changes.size() == 3);
+	CHECK(changes[0].usPerBeat == 9600);
+	CHECK(changes[1].micros == 38400);
+	CHECK(changes[2].micros == 72000);
+	CHECK(m.getTempoMap().tickToMicros(1344) == 129600);
+}
+
+TEST_CASE("Timestamps are only computed on request", "[loading][timing]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	CHECK(m.getTrack(1).getTimestamps().empty());
+
+	REQUIRE(m.loadFile("c.1.3.96", midi::LOAD_TIMESTAMPS));
+	REQUIRE(m.getTracks().size() == 3);
+
+	for(const midi::Track& track : m.getTracks()){
+		REQUIRE(track.getTimestamps().size() == track.getEvents().size());
+	}
+
+	const midi::Track& conductor = m.getTrack(0);
+	CHECK(conductor.getTimestamp(2) == 38400);
+	CHECK(conductor.getTimestamp(3) == 57600);
+	CHECK(conductor.getTimestamp(5) == 129600);
+
+	const midi::Track& piano = m.getTrack(1);
+	CHECK(piano.getTimestamp(2) == 9600);
+	CHECK(piano.getTimestamps().back() == 100800);
+}
+
+TEST_CASE("Time signatures decode", "[loading][bars]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+
+	const midi::Event& event = m.getEvent(0, 3);
+	REQUIRE(event.getType() == midi::TIME_SIGNATURE);
+	CHECK(event.getData().timeSignature.numerator == 3);
+	CHECK(event.getData().timeSignature.denominator == 2);
+	CHECK(event.getData().timeSignature.clocksPerClick == 24);
+}
+
+TEST_CASE("Out of range time signature denominators are clamped", "[loading][bars]"){
+	// 4/2^200
+	const char* file = "huge-denominator.mid";
+	{
+		std::ofstream out(file, std::ios::binary);
+		const unsigned char midiFile[] = {'M','T','h','d', 0,0,0,6, 0,0, 0,1, 0,96,
+			'M','T','r','k', 0,0,0,12, 0,0xFF,0x58,4,4,200,24,8, 0,0xFF,0x2F,0};
+		out.write((const char*)midiFile, sizeof(midiFile));
+	}
+
+	midi::MIDI m;
+	REQUIRE(m.loadFile(file));
+	std::remove(file);
+
+	CHECK(m.getEvent(0, 0).getData().timeSignature.denominator == 31);
+	const midi::BarMap::Segment& segment = m.getBarMap().getSegments().back();
+	CHECK(segment.ticksPerBeat == 1);
+	CHECK(segment.ticksPerBar == 4);
+}
+
+TEST_CASE("Bar map converts ticks and positions", "[bars]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	const midi::BarMap& bars = m.getBarMap();
+
+	REQUIRE(bars.getSegments().size() == 2);
+	CHECK(bars.getSegments()[1].bar == 2);
+	CHECK(bars.getBarStart(1) == 384);
+	CHECK(bars.getBarStart(3) == 1056);
+
+	midi::BarMap::Position position = bars.tickToPosition(1000);
+	CHECK(position.bar == 2);
+	CHECK(position.beat == 2);
+	CHECK(position.tickInBeat == 40);
+	CHECK(bars.positionToTick(position) == 1000);
+
+	position = bars.tickToPosition(500);
+	CHECK(position.bar == 1);
+	CHECK(position.beat == 1);
+	CHECK(position.tickInBeat == 20);
+}
+
+TEST_CASE("Events in bar", "[bars]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+
+	midi::EventRange range = m.eventsInBar(1, 1);
+	REQUIRE(range.size() == 6);
+	CHECK(range.begin()->getTick() == 384);
+	CHECK((range.end() - 1)->getTick() == 576);
+
+	CHECK(m.eventsInBar(1, 3).size() == 1);
+	CHECK(m.eventsInBar(1, 10).empty());
+}
+
+TEST_CASE("Events in tick range", "[range]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+
+	midi::EventRange range = m.getTrack(1).eventsInRange(96, 288);
+	REQUIRE(range.size() == 4);
+	CHECK(range.begin()->getTick() == 96);
+	CHECK((range.end() - 1)->getTick() == 192);
+
+	CHECK(m.getTrack(1).eventsInRange(97, 192).empty());
+	CHECK(m.getTrack(1).eventsInRange(288, 96).empty());
+	CHECK(m.getTrack(1).eventsInRange(0, 5000).size() == m.getTrack(1).getEvents().size());
+
+	std::vector<midi::EventRange> ranges = m.eventsInRange(96, 101);
+	REQUIRE(ranges.size() == 3);
+	CHECK(ranges[0].empty());
+	CHECK(ranges[1].size() == 2);
+	CHECK(ranges[2].size() == 2);
+}
+
+TEST_CASE("Posting list index", "[loading][index]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	CHECK(m.getTrack(2).getIndex().findController(3, 64).empty());
+
+	REQUIRE(m.loadFile("c.1.3.96", midi::LOAD_INDEX));
+	const midi::EventIndex& index = m.getTrack(2).getIndex();
+
+	std::vector<uint32_t> sustain(index.findController(3, 64).begin(), index.findController(3, 64).end());
+	CHECK(sustain == std::vector<uint32_t>{1, 4, 6});
+
+	for(uint32_t i : sustain){
+		CHECK(m.getEvent(2, i).getType() == midi::CONTROLLER);
+		CHECK(m.getEvent(2, i).getChannel() == 3);
+	}
+
+	CHECK(index.find(midi::CONTROLLER, 3).size() == 3);
+	CHECK(index.find(midi::NOTE_ON, 9).size() == 1);
+	CHECK(index.find(midi::NOTE_ON, 3).empty());
+	CHECK(index.findController(3, 7).empty());
+
+	const midi::PostingList& notes = m.getTrack(1).getIndex().find(midi::NOTE_ON, 0);
+	CHECK(notes.size() == 7);
+	CHECK(*notes.begin() == 0);
+}
+
+TEST_CASE("Posting list decodes wide gaps", "[loading][index]"){
+	// Sustain pedal events at indices 0, 200 and 20200, note ons between them
+	const char* file = "wide-gaps.mid";
+	{
+		std::vector<unsigned char> events;
+		for(uint32_t i = 0; i < 20201; i++){
+			const bool sustain = i == 0 || i == 200 || i == 20200;
+			const unsigned char event[] = {0, (unsigned char)(sustain ? 0xB0 : 0x90), (unsigned char)(sustain ? 64 : 60), 0};
+			events.insert(events.end(), event, event + 4);
+		}
+		const unsigned char end[] = {0, 0xFF, 0x2F, 0};
+		events.insert(events.end(), end, end + 4);
+
+		std::ofstream out(file, std::ios::binary);
+		const unsigned char header[] = {'M','T','h','d', 0,0,0,6, 0,0, 0,1, 0,96};
+		out.write((const char*)header, sizeof(header));
+
+		const uint32_t length = events.size();
+		const unsigned char track[] = {'M','T','r','k', (unsigned char)(length >> 24), (unsigned char)(length >> 16), (unsigned char)(length >> 8), (unsigned char)length};
+		out.write((const char*)track, sizeof(track));
+		out.write((const char*)events.data(), events.size());
+	}
+
+	midi::MIDI m;
+	REQUIRE(m.loadFile(file, midi::LOAD_INDEX));
+	std::remove(file);
+
+	const midi::PostingList& sustain = m.getTrack(0).getIndex().findController(0, 64);
+	CHECK(std::vector<uint32_t>(sustain.begin(), sustain.end()) == std::vector<uint32_t>{0, 200, 20200});
+	CHECK(sustain.size() == 3);
+	CHECK(m.getTrack(0).getIndex().find(midi::NOTE_ON, 0).size() == 20198);
+}
+
+TEST_CASE("Notes pair within a track", "[notes]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+
+	std::vector<midi::Note> notes = m.getTrack(1).getNotes();
+	REQUIRE(notes.size() == 6);
+
+	CHECK(notes[0].pitch == 60);
+	CHECK(notes[0].end == 96);
+	CHECK(notes[1].pitch == 64);
+	CHECK(notes[1].end == 192); // Zero velocity note on
+
+	// Overlapping notes of the same pitch close most recent first
+	CHECK(notes[2].start == 96);
+	CHECK(notes[2].velocity == 80);
+	CHECK(notes[2].end == 384);
+	CHECK(notes[3].start == 192);
+	CHECK(notes[3].end == 288);
+
+	CHECK(notes[4].pitch == 67);
+	CHECK(notes[4].end == 480);
+
+	// Dangling note ends with the track
+	CHECK(notes[5].pitch == 72);
+	CHECK(notes[5].end == 1200);
+}
+
+TEST_CASE("Notes resolve sustain pedal", "[notes]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+
+	std::vector<midi::Note> notes = m.getTrack(1).getNotes(midi::PAIR_SUSTAIN);
+	REQUIRE(notes.size() == 6);
+	CHECK(notes[2].end == 384); // Released before the pedal went down
+	CHECK(notes[4].end == 576);
+}
+
+TEST_CASE("Notes merge across tracks", "[notes]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+
+	std::vector<midi::Note> notes = m.getNotes();
+	REQUIRE(notes.size() == 7);
+
+	for(size_t i = 1; i < notes.size(); i++){
+		CHECK(notes[i-1].start <= notes[i].start);
+	}
+
+	CHECK(notes[2].track == 1);
+	CHECK(notes[3].track == 2);
+	CHECK(notes[3].channel == 9);
+	CHECK(notes[3].end == 100);
+}
+
+TEST_CASE("Note index stabbing queries", "[notes][index]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::NoteIndex index(m);
+
+	const auto pitches = [](std::vector<const midi::Note*> notes){
+		std::vector<int> p;
+		for(const midi::Note* note : notes) p.push_back(note->pitch);
+		std::sort(p.begin(), p.end());
+		return p;
+	};
+
+	CHECK(pitches(index.notesAt(0)) == std::vector<int>{60, 64});
+	CHECK(pitches(index.notesAt(96)) == std::vector<int>{36, 60, 64});
+	CHECK(pitches(index.notesAt(200)) == std::vector<int>{60, 60});
+	CHECK(pitches(index.notesAt(480)).empty());
+	CHECK(pitches(index.notesAt(1199)) == std::vector<int>{72});
+	CHECK(index.notesAt(1200).empty());
+	CHECK(index.notesAt(std::numeric_limits<midi::event_delta_t>::max()).empty());
+
+	CHECK(pitches(index.notesIn(90, 101)) == std::vector<int>{36, 60, 60, 64});
+	CHECK(index.notesIn(0, 5000).size() == index.getNotes().size());
+	CHECK(index.notesIn(100, 100).empty());
+
+	// Brute force agrees at every tick
+	for(midi::event_delta_t tick = 0; tick < 1300; tick += 7){
+		size_t expected = 0;
+		for(const midi::Note& note : index.getNotes()){
+			if(note.start <= tick && tick < note.end) expected++;
+		}
+		CHECK(index.notesAt(tick).size() == expected);
+	}
+}
+
+TEST_CASE("Player merges tracks in tick order", "[player]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::MIDIPlayer player(m);
+
+	std::vector<std::pair<midi::event_delta_t, midi::TrackEventType>> played;
+	const auto record = [&](midi::Event e){
+		played.emplace_back(e.getTick(), e.getType());
+	};
+
+	for(midi::TrackEventType type : {midi::SET_TEMPO, midi::TIME_SIGNATURE, midi::NOTE_ON, midi::NOTE_OFF,
+			midi::CONTROLLER, midi::PROGRAM, midi::PITCH_BEND_CHANGE}){
+		player.registerEventCallback(type, record);
+	}
+
+	REQUIRE_FALSE(player.done());
+	player.play();
+	CHECK(player.done());
+
+	// Every event except each track's TRACK_END
+	REQUIRE(played.size() == 26);
+	for(size_t i = 1; i < played.size(); i++){
+		CHECK(played[i-1].first <= played[i].first);
+	}
+
+	// Equal ticks play in track order
+	CHECK(played[0].second == midi::TIME_SIGNATURE);
+	CHECK(played[2].second == midi::NOTE_ON);
+	CHECK(played[4].second == midi::PROGRAM);
+}
+
+namespace{
+	struct NoteCounter{
+		int on = 0;
+		int off = 0;
+
+		void operator()(midi::EventTag<midi::NOTE_ON>, const midi::Event&){ on++; }
+		void operator()(midi::EventTag<midi::NOTE_OFF>, const midi::Event&){ off++; }
+	};
+
+	struct SustainCounter{
+		int& count;
+
+		void operator()(midi::EventTag<midi::CONTROLLER>, const midi::Event& e){
+			if(e.getData().controller.function == 64) count++;
+		}
+	};
+}
+
+TEST_CASE("Static player dispatches by handler overload", "[player]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+
+	int sustain = 0;
+	midi::StaticMIDIPlayer<NoteCounter, SustainCounter> player(m, NoteCounter(), SustainCounter{sustain});
+	player.play();
+
+	CHECK(player.done());
+	CHECK(player.getHandler<0>().on == 8);
+	CHECK(player.getHandler<0>().off == 5);
+	CHECK(sustain == 5);
+}
+
+TEST_CASE("Static player shares the player's controls", "[player]"){
+	std::shared_ptr<const midi::MIDI> m = midi::MIDI::loadShared("c.1.3.96");
+	REQUIRE(m);
+
+	int sustain = 0;
+	midi::StaticMIDIPlayer<NoteCounter, SustainCounter> player(m, NoteCounter(), SustainCounter{sustain});
+	player.setVirtualClock(true);
+	player.setInstrumentation(true);
+
+	player.setChannelMute(0xFFFF);
+	player.play();
+	CHECK(player.getHandler<0>().on == 0);
+	CHECK(sustain == 0);
+	// Only the tempo and time signature events, which have no channel
+	const uint64_t unmuted = player.getStats().events;
+	CHECK(unmuted == 5);
+
+	// Stepped, with an injected note
+	player.setChannelMute(0);
+	player.enableInjection(4);
+	REQUIRE(player.inject(midi::Event(midi::NOTE_ON, 5, 60, 100), 5000));
+	player.seekToTick(0);
+	for(int64_t deadline = player.advanceTo(0); deadline != midi::NO_DEADLINE; deadline = player.advanceTo(deadline)){
+	}
+
+	CHECK(player.getHandler<0>().on == 8 + 1);
+	CHECK(sustain == 5);
+	CHECK(player.getStats().events == unmuted + 26 + 1);
+	CHECK(player.getTime() == 72000);
+}
+
+TEST_CASE("Player follows the exact tempo timeline", "[player][timing]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::MIDIPlayer player(m);
+	player.setSpinThreshold(std::chrono::microseconds(200));
+
+	const auto start = std::chrono::steady_clock::now();
+
+	const auto check = [&](const midi::Event& e){
+		const midi::timestamp_t expected = m.getTempoMap().tickToMicros(e.getTick());
+		CHECK(player.getTime() == expected);
+
+		const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+		CHECK(elapsed.count() >= (int64_t)expected); // Never early
+	};
+
+	for(midi::TrackEventType type : {midi::SET_TEMPO, midi::NOTE_ON, midi::NOTE_OFF, midi::CONTROLLER}){
+		player.registerEventCallback(type, check);
+	}
+
+	player.play();
+	CHECK(player.getTime() == 72000);
+}
+
+TEST_CASE("Latency histogram percentiles", "[player][stats]"){
+	midi::LatencyHistogram histogram;
+	CHECK(histogram.getPercentile(0.5) == 0);
+
+	for(uint64_t i = 1; i <= 10000; i++){
+		histogram.record(i);
+	}
+
+	CHECK(histogram.getCount() == 10000);
+	CHECK(histogram.getMax() == 10000);
+	CHECK(histogram.getPercentile(0.5) >= 5000);
+	CHECK(histogram.getPercentile(0.5) <= 5000 * 1.07);
+	CHECK(histogram.getPercentile(0.99) >= 9900);
+	CHECK(histogram.getPercentile(1.0) == 10000);
+
+	histogram.reset();
+	CHECK(histogram.getCount() == 0);
+}
+
+TEST_CASE("Player reports dispatch stats", "[player][stats]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::MIDIPlayer player(m);
+
+	CHECK(player.getStats().events == 0);
+	player.setInstrumentation(true);
+
+	// The player's timing surrounds the callback's own, so covers at least what it measures
+	int64_t measured = 0;
+	player.registerEventCallback(midi::PROGRAM, [&](const midi::Event&){
+		const auto start = std::chrono::steady_clock::now();
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		measured = std::max<int64_t>(measured, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+	});
+	player.play();
+
+	const midi::PlaybackStats stats = player.getStats();
+	CHECK(stats.events == 26);
+	CHECK(stats.callbackMax >= (uint64_t)measured);
+	CHECK(stats.callbackP50 <= stats.callbackP99);
+	CHECK(stats.callbackP99 <= stats.callbackMax);
+	CHECK(stats.latenessP50 <= stats.latenessP99);
+	CHECK(stats.latenessP99 <= stats.latenessMax);
+}
+
+TEST_CASE("Threaded player queues events for a consumer", "[player][threaded]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::MIDIPlayer player(m);
+
+	int notes = 0;
+	player.registerEventCallback(midi::NOTE_ON, [&](const midi::Event&){ notes++; });
+
+	player.start(8);
+
+	std::vector<midi::TimedEvent> received;
+	for(bool running = true; running;){
+		running = player.isRunning();
+
+		midi::TimedEvent queued;
+		while(player.poll(queued)){
+			received.push_back(queued);
+		}
+	}
+	player.join();
+
+	CHECK(player.getDroppedEvents() == 0);
+	REQUIRE(received.size() == 26);
+	for(const midi::TimedEvent& queued : received){
+		CHECK(queued.time == m.getTempoMap().tickToMicros(queued.event.getTick()));
+	}
+
+	// Queued events can also go to the registered callbacks
+	midi::MIDIPlayer callbackPlayer(m);
+	callbackPlayer.registerEventCallback(midi::NOTE_ON, [&](const midi::Event&){ notes++; });
+	callbackPlayer.start(64);
+	callbackPlayer.join();
+	CHECK(callbackPlayer.dispatchQueued() == 26);
+	CHECK(notes == 8);
+}
+
+TEST_CASE("Virtual clock plays without sleeping", "[player][timing]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::MIDIPlayer player(m);
+	player.setVirtualClock(true);
+
+	std::vector<std::pair<midi::event_delta_t, midi::timestamp_t>> played;
+	for(midi::TrackEventType type : {midi::SET_TEMPO, midi::TIME_SIGNATURE, midi::NOTE_ON, midi::NOTE_OFF,
+			midi::CONTROLLER, midi::PROGRAM, midi::PITCH_BEND_CHANGE}){
+		player.registerEventCallback(type, [&](const midi::Event& e, midi::timestamp_t time){
+			played.emplace_back(e.getTick(), time);
+		});
+	}
+
+	player.play();
+
+	REQUIRE(played.size() == 26);
+	for(const auto& event : played){
+		CHECK(event.second == m.getTempoMap().tickToMicros(event.first));
+	}
+	CHECK(player.getTime() == 72000);
+
+	// A note 2^28 - 1 ticks in, about 16 days at the default tempo, only finishes if nothing waits for it
+	const char* file = "long-gap.mid";
+	{
+		std::ofstream out(file, std::ios::binary);
+		const unsigned char midiFile[] = {'M','T','h','d', 0,0,0,6, 0,0, 0,1, 0,96,
+			'M','T','r','k', 0,0,0,11, 0xFF,0xFF,0xFF,0x7F,0x90,60,100, 0,0xFF,0x2F,0};
+		out.write((const char*)midiFile, sizeof(midiFile));
+	}
+
+	midi::MIDI longGap;
+	REQUIRE(longGap.loadFile(file));
+	std::remove(file);
+
+	midi::MIDIPlayer longPlayer(longGap);
+	longPlayer.setVirtualClock(true);
+	longPlayer.play();
+	CHECK(longPlayer.getTime() == longGap.getTempoMap().tickToMicros(0x0FFFFFFF));
+}
+
+namespace{
+	// Records (tick, time) of every event a player dispatches
+	void recordPlayed(midi::MIDIPlayer& player, std::vector<std::pair<midi::event_delta_t, midi::timestamp_t>>& played){
+		for(midi::TrackEventType type : {midi::SET_TEMPO, midi::TIME_SIGNATURE, midi::NOTE_ON, midi::NOTE_OFF,
+				midi::CONTROLLER, midi::PROGRAM, midi::PITCH_BEND_CHANGE}){
+			player.registerEventCallback(type, [&](const midi::Event& e, midi::timestamp_t time){
+				played.emplace_back(e.getTick(), time);
+			});
+		}
+	}
+}
+
+TEST_CASE("Player seeks by tick and time", "[player][transport]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::MIDIPlayer player(m);
+	player.setVirtualClock(true);
+
+	std::vector<std::pair<midi::event_delta_t, midi::timestamp_t>> played;
+	recordPlayed(player, played);
+
+	player.seekToTick(384);
+	player.play();
+
+	REQUIRE(played.size() == 12);
+	CHECK(played.front().first == 384);
+	for(const auto& event : played){
+		CHECK(event.second == m.getTempoMap().tickToMicros(event.first));
+	}
+
+	// Seeking back restarts a finished player
+	played.clear();
+	player.seekToTime(38400);
+	player.play();
+	CHECK(played.size() == 12);
+
+	played.clear();
+	player.seekToTick(0);
+	player.play();
+	CHECK(played.size() == 26);
+}
+
+TEST_CASE("Player loops a region", "[player][transport]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::MIDIPlayer player(m);
+	player.setVirtualClock(true);
+	player.setLoop(96, 192);
+
+	std::vector<std::pair<midi::event_delta_t, midi::timestamp_t>> played;
+	recordPlayed(player, played);
+	player.registerEventCallback(midi::NOTE_OFF, [&](const midi::Event&){
+		// Three passes of the loop
+		if(played.size() == 6 + 4 * 3) player.stop();
+	});
+
+	player.play();
+
+	REQUIRE(played.size() == 18);
+	for(size_t i = 6; i < played.size(); i++){
+		CHECK(played[i].first >= 96);
+		CHECK(played[i].first < 192);
+	}
+	CHECK(played[6].first == played[10].first);
+	CHECK(played[10].second == m.getTempoMap().tickToMicros(96));
+}
+
+TEST_CASE("Threaded player pauses and resumes", "[player][transport][threaded]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::MIDIPlayer player(m);
+
+	player.pause();
+	player.start(64);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	// Nothing plays while paused, even past the end of the song
+	midi::TimedEvent queued;
+	CHECK_FALSE(player.poll(queued));
+	CHECK(player.isRunning());
+
+	player.resume();
+	player.join();
+	CHECK(player.dispatchQueued() == 26);
+
+	// Stopping ends playback early
+	player.seekToTick(0);
+	player.start(64);
+	player.stop();
+	player.join();
+	CHECK_FALSE(player.isRunning());
+	CHECK(player.dispatchQueued() < 26);
+}
+
+TEST_CASE("Channel state checkpoints", "[state]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::ChannelStateIndex index(m, 100);
+
+	midi::ChannelSnapshot state = index.getStateAt(500);
+	CHECK(state.getChannel(3).program == 5);
+	CHECK(state.getChannel(3).controllers[64] == 0);
+	CHECK(state.getChannel(3).pitchBend == 0x48 << 7);
+	CHECK(state.getChannel(3).pressure == -1);
+	CHECK(state.getChannel(0).controllers[64] == 127);
+	CHECK(state.getChannel(0).controllers[7] == -1);
+	CHECK(state.getChannel(0).program == -1);
+
+	state = index.getStateAt(1000);
+	CHECK(state.getChannel(3).controllers[64] == 127);
+	CHECK(state.getChannel(0).controllers[64] == 0);
+	CHECK(state.getChannel(0).controllers[7] == 100);
+
+	// Events on the tick itself aren't included
+	CHECK(index.getStateAt(384).getChannel(0).controllers[64] == -1);
+
+	// Any interval gives the same state
+	midi::ChannelStateIndex fine(m, 1), coarse(m, 100000);
+	for(midi::event_delta_t tick = 0; tick < 1400; tick += 13){
+		const midi::ChannelSnapshot fineState = fine.getStateAt(tick), coarseState = coarse.getStateAt(tick);
+		for(midi::channel_t channel : {0, 3}){
+			const midi::ChannelState& a = fineState.getChannel(channel);
+			const midi::ChannelState& b = coarseState.getChannel(channel);
+			CHECK(a.program == b.program);
+			CHECK(a.pitchBend == b.pitchBend);
+			CHECK(std::equal(a.controllers, a.controllers + 128, b.controllers));
+		}
+	}
+}
+
+TEST_CASE("Channel state checkpoints skip unchanged intervals", "[state]"){
+	// A program change at tick 0 and a controller 2^28 - 1 ticks later
+	const char* file = "sparse-state.mid";
+	{
+		std::ofstream out(file, std::ios::binary);
+		const unsigned char midiFile[] = {'M','T','h','d', 0,0,0,6, 0,0, 0,1, 0,96,
+			'M','T','r','k', 0,0,0,14, 0,0xC0,5, 0xFF,0xFF,0xFF,0x7F,0xB0,7,100, 0,0xFF,0x2F,0};
+		out.write((const char*)midiFile, sizeof(midiFile));
+	}
+
+	midi::MIDI m;
+	REQUIRE(m.loadFile(file));
+	std::remove(file);
+
+	// One checkpoint per tick would need a snapshot for every one of them
+	midi::ChannelStateIndex index(m, 1);
+	CHECK(index.getStateAt(1).getChannel(0).program == 5);
+	CHECK(index.getStateAt(0x0FFFFFFF).getChannel(0).controllers[7] == -1);
+	CHECK(index.getStateAt(0x10000000).getChannel(0).controllers[7] == 100);
+	CHECK(index.getStateAt(0xFFFFFFFF).getChannel(0).program == 5);
+}
+
+TEST_CASE("Channel snapshots handle controller resets and parameter selects", "[state]"){
+	midi::ChannelSnapshot state;
+	state.apply(midi::Event(midi::CONTROLLER, 0, 64, 127));
+	state.apply(midi::Event(midi::CONTROLLER, 0, 121, 0));
+	state.apply(midi::Event(midi::CONTROLLER, 0, 7, 100));
+	state.apply(midi::Event(midi::CONTROLLER, 0, 123, 0));
+
+	// Data entry for RPN 0, then NRPN 1 selected afterwards with its own data
+	state.apply(midi::Event(midi::CONTROLLER, 1, 101, 0));
+	state.apply(midi::Event(midi::CONTROLLER, 1, 100, 0));
+	state.apply(midi::Event(midi::CONTROLLER, 1, 6, 12));
+	state.apply(midi::Event(midi::CONTROLLER, 1, 99, 0));
+	state.apply(midi::Event(midi::CONTROLLER, 1, 98, 1));
+	state.apply(midi::Event(midi::CONTROLLER, 1, 96, 0));
+	state.apply(midi::Event(midi::CONTROLLER, 1, 6, 40));
+
+	const midi::ChannelState& reset = state.getChannel(0);
+	CHECK(reset.controllers[64] == 0);
+	CHECK(reset.controllers[11] == 127);
+	CHECK(reset.controllers[7] == 100);
+	CHECK(reset.pitchBend == 0x2000);
+	for(int controller = 120; controller < 128; controller++){
+		CHECK(reset.controllers[controller] == -1);
+	}
+	CHECK(state.getChannel(1).controllers[96] == -1);
+
+	std::vector<midi::Event> events;
+	state.getEvents(0, events);
+
+	// No channel mode messages, so nothing undoes the restored volume
+	std::vector<int> channel0, channel1;
+	for(const midi::Event& e : events){
+		if(e.getType() != midi::CONTROLLER) continue;
+		CHECK(e.getData().controller.function < 120);
+		(e.getChannel() == 0 ? channel0 : channel1).push_back(e.getData().controller.function);
+	}
+	CHECK(std::find(channel0.begin(), channel0.end(), 7) != channel0.end());
+
+	// The NRPN select comes last, right before its data entry
+	CHECK(channel1 == std::vector<int>({101, 100, 99, 98, 6}));
+}
+
+TEST_CASE("Player chases channel state after seeking", "[player][state]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::ChannelStateIndex index(m, 100);
+
+	midi::MIDIPlayer player(m);
+	player.setVirtualClock(true);
+	player.setChannelStateIndex(&index);
+
+	std::vector<midi::Event> played;
+	for(midi::TrackEventType type : {midi::NOTE_ON, midi::CONTROLLER, midi::PROGRAM, midi::PITCH_BEND_CHANGE}){
+		player.registerEventCallback(type, [&](const midi::Event& e){ played.push_back(e); });
+	}
+
+	player.seekToTick(500);
+	player.play();
+
+	REQUIRE(played.size() >= 4);
+	CHECK(played[0].getType() == midi::CONTROLLER);
+	CHECK(played[0].getChannel() == 0);
+	CHECK(played[0].getData().controller.value == 127);
+
+	CHECK(played[1].getType() == midi::PROGRAM);
+	CHECK(played[1].getChannel() == 3);
+	CHECK(played[1].getData().program.program == 5);
+
+	CHECK(played[2].getType() == midi::CONTROLLER);
+	CHECK(played[2].getData().controller.value == 0);
+
+	CHECK(played[3].getType() == midi::PITCH_BEND_CHANGE);
+	CHECK(played[3].getData().pitchBend.MSB == 0x48);
+
+	for(int i = 0; i < 4; i++){
+		CHECK(played[i].getTick() == 500);
+	}
+	CHECK(played[4].getTick() == 576);
+}
+
+TEST_CASE("Scheduler plays many players on few threads", "[player][scheduler]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+
+	const size_t count = 64;
+	std::vector<std::unique_ptr<midi::MIDIPlayer>> players;
+	std::vector<std::vector<std::pair<midi::event_delta_t, midi::timestamp_t>>> played(count);
+
+	for(size_t i = 0; i < count; i++){
+		players.emplace_back(new midi::MIDIPlayer(m));
+		recordPlayed(*players.back(), played[i]);
+	}
+
+	midi::PlayerScheduler scheduler(2);
+	for(auto& player : players){
+		scheduler.add(*player);
+	}
+
+	scheduler.wait();
+	CHECK(scheduler.getActivePlayers() == 0);
+
+	for(size_t i = 0; i < count; i++){
+		REQUIRE(played[i].size() == 26);
+		CHECK(played[i].back().second == 72000);
+		for(const auto& event : played[i]){
+			CHECK(event.second == m.getTempoMap().tickToMicros(event.first));
+		}
+		CHECK(players[i]->done());
+	}
+
+	// A finished player can be seeked back and scheduled again
+	played[0].clear();
+	players[0]->seekToTick(384);
+	scheduler.add(*players[0]);
+	scheduler.wait();
+	CHECK(played[0].size() == 12);
+}
+
+TEST_CASE("Player advances from an external loop", "[player][step]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::MIDIPlayer player(m);
+
+	std::vector<std::pair<midi::event_delta_t, midi::timestamp_t>> played;
+	recordPlayed(player, played);
+
+	// The caller's clock doesn't start at zero
+	const int64_t origin = 5000000;
+
+	// Only what is due at the start, everything on tick 0
+	int64_t deadline = player.advanceTo(origin);
+	CHECK(player.getNextDeadline() == deadline);
+	for(const auto& event : played){
+		CHECK(event.first == 0);
+	}
+	CHECK(deadline == origin + m.getTempoMap().tickToMicros(96));
+
+	// Halfway to a deadline nothing happens
+	const size_t dispatched = played.size();
+	CHECK(player.advanceTo(origin + 100) == deadline);
+	CHECK(played.size() == dispatched);
+
+	int steps = 1;
+	while(deadline != midi::NO_DEADLINE){
+		deadline = player.advanceTo(deadline);
+		steps++;
+	}
+
+	REQUIRE(played.size() == 26);
+	for(const auto& event : played){
+		CHECK(event.second == m.getTempoMap().tickToMicros(event.first));
+	}
+	CHECK(player.done());
+	CHECK(player.getNextDeadline() == midi::NO_DEADLINE);
+	// One step per distinct tick with events
+	CHECK(steps == 11);
+
+	// Late steps catch up in one call
+	played.clear();
+	player.seekToTick(0);
+	CHECK(player.advanceTo(0) != midi::NO_DEADLINE);
+	CHECK(player.advanceTo(1000000) == midi::NO_DEADLINE);
+	CHECK(played.size() == 26);
+}
+
+TEST_CASE("Player delivers same tick events as one batch", "[player][batch]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::MIDIPlayer player(m);
+	player.setVirtualClock(true);
+
+	size_t events = 0;
+	player.registerEventCallback(midi::NOTE_ON, [&](const midi::Event&){ events++; });
+
+	std::vector<std::vector<midi::Event>> batches;
+	std::vector<midi::timestamp_t> times;
+	player.registerBatchCallback([&](const midi::EventRange& range, midi::timestamp_t time){
+		// Event callbacks have already run for the whole batch
+		size_t notes = 0;
+		for(const midi::Event& e : range){
+			if(e.getType() == midi::NOTE_ON) notes++;
+		}
+		CHECK(events >= notes);
+
+		batches.emplace_back(range.begin(), range.end());
+		times.push_back(time);
+	});
+
+	player.play();
+
+	// One batch per distinct tick
+	REQUIRE(batches.size() == 11);
+
+	size_t total = 0;
+	for(size_t i = 0; i < batches.size(); i++){
+		REQUIRE(!batches[i].empty());
+		for(const midi::Event& e : batches[i]){
+			CHECK(e.getTick() == batches[i].front().getTick());
+		}
+		CHECK(times[i] == m.getTempoMap().tickToMicros(batches[i].front().getTick()));
+		if(i) CHECK(batches[i].front().getTick() > batches[i - 1].front().getTick());
+
+		total += batches[i].size();
+	}
+	CHECK(total == 26);
+
+	// Both tracks' events at tick 0 arrive in a single call
+	CHECK(batches[0].size() == 6);
+
+	// The chord change at tick 192 spans two tracks
+	const auto& chord = batches[3];
+	CHECK(chord.front().getTick() == 192);
+	CHECK(chord.size() == 3);
+
+	// Stepping delivers the same batches
+	batches.clear();
+	player.seekToTick(0);
+	for(int64_t deadline = player.advanceTo(0); deadline != midi::NO_DEADLINE; deadline = player.advanceTo(deadline)){
+	}
+	CHECK(batches.size() == 11);
+}
+
+TEST_CASE("Player plays batches alone", "[player][batch]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::MIDIPlayer player(m);
+	player.setVirtualClock(true);
+	player.enableInjection(4);
+
+	size_t events = 0;
+	player.registerEventCallback(midi::NOTE_ON, [&](const midi::Event&){ events++; });
+
+	std::vector<size_t> sizes;
+	std::vector<midi::timestamp_t> times;
+	player.registerBatchCallback([&](const midi::EventRange& range, midi::timestamp_t time){
+		sizes.push_back(range.size());
+		times.push_back(time);
+	});
+
+	// Between the batches on ticks 0 and 96
+	REQUIRE(player.inject(midi::Event(midi::NOTE_ON, 5, 60, 100), 5000));
+	player.playBatches();
+
+	CHECK(events == 0);
+	REQUIRE(sizes.size() == 11 + 1);
+	CHECK(sizes[0] == 6);
+	CHECK(sizes[1] == 1);
+	CHECK(times[1] == 5000);
+	CHECK(std::accumulate(sizes.begin(), sizes.end(), size_t(0)) == 26 + 1);
+
+	// Stepping delivers the same batches
+	sizes.clear();
+	player.seekToTick(0);
+	for(int64_t deadline = player.advanceBatchesTo(0); deadline != midi::NO_DEADLINE; deadline = player.advanceBatchesTo(deadline)){
+	}
+	CHECK(sizes.size() == 11);
+	CHECK(events == 0);
+}
+
+TEST_CASE("Player batches chased state with the tick it was chased to", "[player][batch][state]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::ChannelStateIndex index(m, 100);
+
+	midi::MIDIPlayer player(m);
+	player.setVirtualClock(true);
+	player.setChannelStateIndex(&index);
+
+	size_t pitchBends = 0;
+	player.registerEventCallback(midi::PITCH_BEND_CHANGE, [&](const midi::Event&){ pitchBends++; });
+
+	std::vector<std::vector<midi::Event>> batches;
+	player.registerBatchCallback([&](const midi::EventRange& range, midi::timestamp_t){
+		batches.emplace_back(range.begin(), range.end());
+	});
+
+	player.seekToTick(500);
+	player.play();
+
+	REQUIRE(batches.size() >= 2);
+	CHECK(batches[0].size() >= 4);
+	for(const midi::Event& e : batches[0]){
+		CHECK(e.getTick() == 500);
+	}
+	CHECK(batches[1].front().getTick() == 576);
+
+	// The chased pitch bend is in the batch as well as its callback
+	CHECK(pitchBends >= 1);
+	CHECK(std::count_if(batches[0].begin(), batches[0].end(), [](const midi::Event& e){
+		return e.getType() == midi::PITCH_BEND_CHANGE;
+	}) == 1);
+}
+
+TEST_CASE("Player renders audio blocks with sample offsets", "[player][render]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+
+	for(uint32_t sampleRate : {44100u, 48000u}){
+		midi::MIDIPlayer player(m);
+
+		const uint32_t frames = 128;
+		midi::BlockEvent out[32];
+
+		std::vector<midi::BlockEvent> rendered;
+		uint64_t block = 0;
+		for(; !player.done() && block < 10000; block++){
+			const size_t count = player.render(frames, sampleRate, out, 32);
+			for(size_t i = 0; i < count; i++){
+				CHECK(out[i].offset < frames);
+
+				// Absolute sample the event fell on
+				const uint64_t sample = block * frames + out[i].offset;
+				CHECK(sample == m.getTempoMap().tickToMicros(out[i].event.getTick()) * sampleRate / 1000000);
+				rendered.push_back(out[i]);
+			}
+		}
+
+		CHECK(rendered.size() == 26);
+		CHECK(player.getDroppedEvents() == 0);
+		// The last event at 72 ms
+		CHECK(block == 72000 * sampleRate / 1000000 / frames + 1);
+	}
+
+	// Events that don't fit are dropped
+	midi::MIDIPlayer player(m);
+	midi::BlockEvent out[2];
+	CHECK(player.render(128, 48000, out, 2) == 2);
+	CHECK(player.getDroppedEvents() == 4);
+	CHECK(out[0].event.getTick() == 0);
+}
+
+TEST_CASE("Player mutes and solos channels and tracks", "[player][mute]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::MIDIPlayer player(m);
+	player.setVirtualClock(true);
+
+	std::vector<std::pair<midi::event_delta_t, midi::timestamp_t>> played;
+	recordPlayed(player, played);
+
+	const auto playFromStart = [&]{
+		played.clear();
+		player.seekToTick(0);
+		player.play();
+		return played.size();
+	};
+
+	// Drums on channel 9
+	player.setChannelMute(1 << 9);
+	CHECK(playFromStart() == 24);
+
+	// Solo wins over everything not soloed, meta events always pass
+	player.setChannelMute(0);
+	player.setChannelSolo(1 << 3);
+	CHECK(playFromStart() == 5 + 5);
+
+	// Muting the soloed channel leaves nothing but meta events
+	player.setChannelMute(1 << 3);
+	CHECK(playFromStart() == 5);
+
+	player.setChannelMute(0);
+	player.setChannelSolo(0);
+	player.setTrackMute(1 << 1);
+	CHECK(playFromStart() == 12);
+
+	// Muted tempo changes still move the timeline
+	player.setTrackMute(0);
+	player.setTrackSolo(1 << 2);
+	CHECK(playFromStart() == 7);
+	for(const auto& event : played){
+		CHECK(event.second == m.getTempoMap().tickToMicros(event.first));
+	}
+
+	player.setTrackSolo(0);
+	CHECK(playFromStart() == 26);
+
+	// A muted event closing a tick still ends its batch
+	size_t batches = 0;
+	size_t batched = 0;
+	player.registerBatchCallback([&](const midi::EventRange& range, midi::timestamp_t){
+		for(const midi::Event& e : range){
+			CHECK(e.getTick() == range.begin()->getTick());
+		}
+		batches++;
+		batched += range.size();
+	});
+	player.setChannelMute(1 << 9);
+	playFromStart();
+	CHECK(batches == 10);
+	CHECK(batched == 24);
+}
+
+TEST_CASE("Player handles empty and finished tracks", "[player]"){
+	// An empty track chunk and a track without TRACK_END
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.2.96"));
+	REQUIRE(m.getTrack(0).getEvents().empty());
+	REQUIRE(m.getTrack(1).getEvents().size() == 2);
+
+	midi::MIDIPlayer player(m);
+	player.setVirtualClock(true);
+
+	std::vector<std::pair<midi::event_delta_t, midi::timestamp_t>> played;
+	recordPlayed(player, played);
+
+	player.play();
+	CHECK(played.size() == 2);
+	CHECK(player.done());
+
+	// Finished tracks don't start over from their first event
+	played.clear();
+	player.play();
+	CHECK(played.empty());
+	CHECK(player.advanceTo(0) == midi::NO_DEADLINE);
+	CHECK(played.empty());
+}
+
+TEST_CASE("Player hot swaps shared snapshots", "[player][snapshot]"){
+	std::shared_ptr<const midi::MIDI> first = midi::MIDI::loadShared("c.1.3.96");
+	std::shared_ptr<const midi::MIDI> second = midi::MIDI::loadShared("c.1.2.96");
+	REQUIRE(first);
+	REQUIRE(second);
+	CHECK(!midi::MIDI::loadShared("does-not-exist"));
+
+	// A failed load can't be played or swapped in
+	CHECK_THROWS_AS(midi::MIDIPlayer(std::shared_ptr<const midi::MIDI>()), std::invalid_argument);
+	{
+		midi::MIDIPlayer checked(second);
+		CHECK_THROWS_AS(checked.swapAt(nullptr, 0), std::invalid_argument);
+	}
+
+	// Players keep their snapshot alive
+	std::weak_ptr<const midi::MIDI> watch = first;
+	std::unique_ptr<midi::MIDIPlayer> player(new midi::MIDIPlayer(first));
+	midi::MIDIPlayer other(first);
+	first.reset();
+	CHECK(!watch.expired());
+
+	std::vector<std::pair<midi::event_delta_t, midi::timestamp_t>> played;
+	recordPlayed(*player, played);
+
+	// Swap to the two track file at tick 96, where its note off still has to play
+	player->swapAt(second, 96);
+	std::vector<int64_t> deadlines;
+	for(int64_t deadline = player->advanceTo(0); deadline != midi::NO_DEADLINE; deadline = player->advanceTo(deadline)){
+		deadlines.push_back(deadline);
+	}
+
+	// The six events on tick 0, then the second file's note off
+	REQUIRE(played.size() == 7);
+	for(size_t i = 0; i < 6; i++){
+		CHECK(played[i].first == 0);
+	}
+	CHECK(played[6].first == 96);
+	// Times follow the new file, but the wall clock carries on from the first file's tick 96
+	CHECK(played[6].second == second->getTempoMap().tickToMicros(96));
+	REQUIRE(deadlines.size() == 1);
+	CHECK(deadlines[0] == watch.lock()->getTempoMap().tickToMicros(96));
+
+	player.reset();
+	CHECK(!watch.expired());
+
+	// A swap behind the playhead applies at the current tick
+	played.clear();
+	recordPlayed(other, played);
+	other.setVirtualClock(true);
+	other.seekToTick(600);
+	other.swapAt(second, 0);
+	other.play();
+	CHECK(played.empty());
+	CHECK(other.done());
+
+	// The playing thread never frees a snapshot, the next swap does
+	std::shared_ptr<const midi::MIDI> third = midi::MIDI::loadShared("c.1.3.96");
+	std::weak_ptr<const midi::MIDI> watchSecond = second;
+	second.reset();
+	CHECK(!watchSecond.expired());
+	other.swapAt(third, 0);
+	CHECK(!watchSecond.expired());
+	other.seekToTick(0);
+	other.play();
+	CHECK(!watchSecond.expired());
+	other.swapAt(third, 0);
+	CHECK(watchSecond.expired());
+
+	// The latest of several pending swaps wins, time seeks use the current snapshot
+	played.clear();
+	other.swapAt(midi::MIDI::loadShared("c.1.2.96"), 0);
+	other.swapAt(third, 0);
+	other.seekToTime(38400);
+	other.play();
+	CHECK(played.size() == 12);
+}
+
+TEST_CASE("MPSC queue keeps each producer's order", "[queue]"){
+	midi::MPSCQueue<std::pair<int, int>> queue(100);
+	CHECK(queue.getCapacity() == 128);
+	CHECK(queue.empty());
+
+	const int producers = 4;
+	const int items = 20000;
+
+	std::vector<std::thread> threads;
+	for(int p = 0; p < producers; p++){
+		threads.emplace_back([&queue, p]{
+			for(int i = 0; i < items; i++){
+				while(!queue.push({p, i})){
+					std::this_thread::yield();
+				}
+			}
+		});
+	}
+
+	std::vector<int> next(producers, 0);
+	int popped = 0;
+	std::pair<int, int> item;
+	while(popped < producers * items){
+		if(!queue.pop(item)) continue;
+
+		CHECK(item.second == next[item.first]);
+		next[item.first] = item.second + 1;
+		popped++;
+	}
+
+	for(std::thread& thread : threads){
+		thread.join();
+	}
+	CHECK(queue.empty());
+
+	// Full after a lap
+	for(int i = 0; i < 128; i++){
+		CHECK(queue.push({0, i}));
+	}
+	CHECK(!queue.push({0, 128}));
+	CHECK(queue.pop(item));
+	CHECK(queue.push({0, 128}));
+}
+
+TEST_CASE("Player merges injected events", "[player][inject]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::MIDIPlayer player(m);
+
+	std::vector<std::pair<midi::event_delta_t, midi::timestamp_t>> played;
+	recordPlayed(player, played);
+
+	// Not enabled yet
+	CHECK(!player.inject(midi::Event(midi::NOTE_ON, 5, 60, 100), 0));
+	player.enableInjection(4);
+
+	// Between the file's events on ticks 0 and 96 (9600us), and past the file's end
+	CHECK(player.inject(midi::Event(midi::NOTE_ON, 5, 60, 100), 5000));
+	CHECK(player.inject(midi::Event(midi::NOTE_OFF, 5, 60), 100000));
+
+	std::vector<int64_t> deadlines;
+	int64_t deadline = player.advanceTo(0);
+	CHECK(deadline == 5000);
+
+	// Injected late, plays on the next step
+	CHECK(player.inject(midi::Event(midi::CONTROLLER, 5, 7, 90), 1000));
+	CHECK(player.advanceTo(2000) == 5000);
+	CHECK(played.back().second == 1000);
+
+	while(deadline != midi::NO_DEADLINE){
+		deadlines.push_back(deadline);
+		deadline = player.advanceTo(deadline);
+	}
+
+	REQUIRE(played.size() == 29);
+	for(size_t i = 1; i < played.size(); i++){
+		CHECK(played[i].second >= played[i - 1].second);
+	}
+	CHECK(played[7].second == 5000);
+	CHECK(played.back().second == 100000);
+	CHECK(deadlines.back() == 100000);
+}
+
+TEST_CASE("Threaded player merges events injected from other threads", "[player][inject][threaded]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::MIDIPlayer player(m);
+	player.enableInjection(64);
+
+	std::vector<std::thread> threads;
+	for(int p = 0; p < 2; p++){
+		threads.emplace_back([&player, p]{
+			for(int i = 0; i < 10; i++){
+				CHECK(player.inject(midi::Event(midi::NOTE_ON, p, 60 + i, 100), 10000 + i * 3000));
+			}
+		});
+	}
+
+	for(std::thread& thread : threads){
+		thread.join();
+	}
+
+	player.start();
+	// While the timing thread is sleeping towards its next event
+	std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	CHECK(player.inject(midi::Event(midi::NOTE_OFF, 0, 60), 60000));
+	player.join();
+
+	std::vector<midi::TimedEvent> events;
+	midi::TimedEvent event;
+	while(player.poll(event)){
+		events.push_back(event);
+	}
+
+	REQUIRE(events.size() == 26 + 21);
+	for(size_t i = 1; i < events.size(); i++){
+		CHECK(events[i].time >= events[i - 1].time);
+	}
+	CHECK(player.getDroppedEvents() == 0);
+}
+
+TEST_CASE("Player applies the real-time options it can", "[player][realtime]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::MIDIPlayer player(m);
+	player.setVirtualClock(true);
+
+	CHECK(player.getRealtimeApplied() == midi::REALTIME_NONE);
+
+	// Priority and memory locking need privileges, playback carries on without them
+	const uint32_t options = midi::REALTIME_PRIORITY | midi::REALTIME_AFFINITY | midi::REALTIME_PREFAULT;
+	player.setRealtime(options, 10, 0);
+	player.start();
+	player.join();
+
+	const uint32_t applied = player.getRealtimeApplied();
+	CHECK((applied & ~options) == 0);
+	CHECK((applied & midi::REALTIME_PREFAULT));
+
+	midi::TimedEvent event;
+	size_t events = 0;
+	while(player.poll(event)){
+		events++;
+	}
+	CHECK(events == 26);
+
+	// CPUs cpu_set_t can't hold are reported as not applied
+	for(int cpu : {-1, 1 << 20}){
+		player.setRealtime(midi::REALTIME_AFFINITY, 10, cpu);
+		player.seekToTick(0);
+		player.start();
+		player.join();
+		CHECK(player.getRealtimeApplied() == midi::REALTIME_NONE);
+	}
+}
+
+TEST_CASE("Steady state playback doesn't allocate", "[player][alloc]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::ChannelStateIndex states(m, 96);
+
+	midi::MIDIPlayer player(m);
+	player.setInstrumentation(true);
+	player.setChannelStateIndex(&states);
+	player.setChannelMute(1 << 9);
+	player.enableInjection(16);
+
+	// Every kind of callback, none of which allocate themselves
+	size_t dispatched = 0;
+	size_t expected = 0;
+	const auto count = [&](const midi::Event&, midi::timestamp_t){
+		dispatched++;
+		if(dispatched == 1) countAllocations = true;
+		if(dispatched == expected) countAllocations = false;
+	};
+	for(midi::TrackEventType type : {midi::SET_TEMPO, midi::TIME_SIGNATURE, midi::NOTE_ON, midi::NOTE_OFF,
+			midi::CONTROLLER, midi::PROGRAM, midi::PITCH_BEND_CHANGE}){
+		player.registerEventCallback(type, count);
+	}
+
+	size_t batches = 0;
+	player.registerBatchCallback([&](const midi::EventRange&, midi::timestamp_t){ batches++; });
+
+	// The drums on channel 9 are muted, plus one injected event
+	expected = 24 + 1;
+	REQUIRE(player.inject(midi::Event(midi::NOTE_ON, 0, 50, 100), 20000));
+
+	allocations = 0;
+	player.play();
+	CHECK(dispatched == expected);
+	CHECK(countAllocations == false);
+	CHECK(allocations == 0);
+
+	// A seek with chasing, then stepping to the end
+	dispatched = 0;
+	expected = 0;
+	player.seekToTick(384);
+	for(int64_t deadline = player.advanceTo(0); deadline != midi::NO_DEADLINE; deadline = player.advanceTo(deadline)){
+	}
+	countAllocations = false;
+
+	CHECK(dispatched > 12);
+	CHECK(allocations == 0);
+	CHECK(batches > 0);
+
+	// A swap to a snapshot with more tracks, sized by swapAt on this thread
+	std::shared_ptr<const midi::MIDI> narrow = midi::MIDI::loadShared("c.1.2.96");
+	std::shared_ptr<const midi::MIDI> wide = midi::MIDI::loadShared("c.1.3.96");
+	REQUIRE(narrow);
+	REQUIRE(wide);
+
+	midi::MIDIPlayer swapping(narrow);
+	swapping.setVirtualClock(true);
+	dispatched = 0;
+	expected = 0;
+	for(midi::TrackEventType type : {midi::SET_TEMPO, midi::TIME_SIGNATURE, midi::NOTE_ON, midi::NOTE_OFF,
+			midi::CONTROLLER, midi::PROGRAM, midi::PITCH_BEND_CHANGE}){
+		swapping.registerEventCallback(type, count);
+	}
+
+	swapping.swapAt(wide, 96);
+	swapping.play();
+	countAllocations = false;
+
+	// The narrow file's note on, then the wide one from tick 96
+	CHECK(dispatched > 2);
+	CHECK(allocations == 0);
+}
+
+TEST_CASE("Player solos and mutes past the 64th track", "[player][mute]"){
+	// 70 tracks with one note each
+	const char* file = "many-tracks.mid";
+	{
+		const uint16_t tracks = 70;
+		std::ofstream out(file, std::ios::binary);
+		const unsigned char header[] = {'M','T','h','d', 0,0,0,6, 0,1, 0,tracks, 0,96};
+		out.write((const char*)header, sizeof(header));
+
+		for(uint16_t i = 0; i < tracks; i++){
+			const unsigned char track[] = {'M','T','r','k', 0,0,0,8, 0,0x90,60,100, 0,0xFF,0x2F,0};
+			out.write((const char*)track, sizeof(track));
+		}
+	}
+
+	midi::MIDI m;
+	REQUIRE(m.loadFile(file));
+	std::remove(file);
+	REQUIRE(m.getTracks().size() == 70);
+
+	midi::MIDIPlayer player(m);
+	player.setVirtualClock(true);
+
+	size_t notes = 0;
+	player.registerEventCallback(midi::NOTE_ON, [&](const midi::Event&){ notes++; });
+	const auto playFromStart = [&]{
+		notes = 0;
+		player.seekToTick(0);
+		player.play();
+		return notes;
+	};
+
+	CHECK(playFromStart() == 70);
+
+	// Soloing a low track silences the high ones too
+	player.setTrackSolo(1 << 3);
+	CHECK(playFromStart() == 1);
+
+	player.setTrackSoloed(68, true);
+	CHECK(playFromStart() == 2);
+
+	player.setTrackSolo(0);
+	player.setTrackSoloed(68, false);
+	player.setTrackMuted(69, true);
+	player.setTrackMuted(1, true);
+	CHECK(playFromStart() == 68);
+
+	player.setTrackMute(0);
+	CHECK(playFromStart() == 69);
+}
+
+TEST_CASE("Player restores the calling thread after playing", "[player][realtime]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::MIDIPlayer player(m);
+	player.setVirtualClock(true);
+
+	int policy;
+	sched_param param;
+	REQUIRE(pthread_getschedparam(pthread_self(), &policy, &param) == 0);
+	cpu_set_t cpus;
+	REQUIRE(pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0);
+
+	player.setRealtime(midi::REALTIME_PRIORITY | midi::REALTIME_AFFINITY, 10, 0);
+	player.play();
+
+	int policyAfter;
+	sched_param paramAfter;
+	REQUIRE(pthread_getschedparam(pthread_self(), &policyAfter, &paramAfter) == 0);
+	CHECK(policyAfter == policy);
+	CHECK(paramAfter.sched_priority == param.sched_priority);
+
+	cpu_set_t cpusAfter;
+	REQUIRE(pthread_getaffinity_np(pthread_self(), sizeof(cpusAfter), &cpusAfter) == 0);
+	CHECK(CPU_EQUAL(&cpus, &cpusAfter));
+}
+
+TEST_CASE("Player bounds the injected events waiting to play", "[player][inject]"){
+	midi::MIDI m;
+	REQUIRE(m.loadFile("c.1.3.96"));
+	midi::MIDIPlayer player(m);
+	player.enableInjection(4);
+
+	std::vector<std::pair<midi::event_delta_t, midi::timestamp_t>> played;
+	recordPlayed(player, played);
+
+	for(int i = 0; i < 4; i++){
+		REQUIRE(player.inject(midi::Event(midi::NOTE_ON, 1, 60 + i, 100), 150000 + i));
+	}
+	// Full, reported instead of held back behind the later events
+	CHECK(!player.inject(midi::Event(midi::NOTE_ON, 1, 70, 100), 0));
+
+	// Still full once they've moved out of the queue
+	player.advanceTo(0);
+	CHECK(player.advanceTo(72000) == 150000);
+	CHECK(played.size() == 26);
+	CHECK(!player.inject(midi::Event(midi::NOTE_ON, 1, 70, 100), 80000));
+
+	// Each one played makes room, and a due event goes ahead of the ones still waiting
+	CHECK(player.advanceTo(150000) == 150001);
+	CHECK(player.inject(midi::Event(midi::CONTROLLER, 1, 7, 90), 100000));
+	CHECK(player.advanceTo(150000) == 150001);
+	REQUIRE(played.size() == 28);
+	CHECK(played.back().second == 100000);
+
+	CHECK(player.advanceTo(150003) == midi::NO_DEADLINE);
+	CHECK(played.size() == 31);
+	CHECK(played.back().second == 150003);
 }